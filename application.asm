@@ -15,6 +15,19 @@
 ; - 16 bit real mode (e.g., in an emulator or a 16 bit capable system)
 ; - Loaded by a bootloader that sets up segments correctly and jumps to 0a000
 ;
+; Profiling build:
+; - Assembled with '-DPROFILE' (and '-DPROFILE_TSC', as the bootloader was) it also displays
+;   the time the bootloader spent loading and unpacking, from the timestamps the bootloader
+;   leaves under its stack, as hex numbers of BIOS ticks (or time stamp counter cycles)
+;
+; Serial build:
+; - Assembled with '-DSERIAL' it writes its output to COM1 instead (ending it with a line break),
+;   for QEMU's '-serial stdio' and headless runs
+;
+; Benchmark build:
+; - Assembled with '-DQEMU_EXIT' it ends QEMU once done, through the isa-debug-exit device
+;   ('-device isa-debug-exit,iobase=0xf4,iosize=0x04', exit status 1), see bench-boot.sh
+;
 ; MIT License:
 ; 
 ; Copyright (c) 2024 Patrik Sporre
@@ -40,6 +53,25 @@
 bits 16                     ; Instruct NASM that this code is 16-bit (real mode)
 org 0xa000                  ; Set origin to 0xA000, where this application is loaded by the bootloader
 
+; Bootloader timestamps, as in boot.asm
+%ifdef PROFILE_TSC
+%define PROFILE_SLOT 8      ; Size of a timestamp: the time stamp counter (qword)
+%else
+%define PROFILE_SLOT 2      ; Size of a timestamp: low word of the BIOS tick count
+%endif
+%define PROFILE_ADDR (0x7c00 - 3 * PROFILE_SLOT) ; Timestamps of the jump, unpack and load phases
+
+%define COM1_PORT 0x3f8     ; COM1 transmit register, the line status register is 5 above
+
+; Outputs the character in AL, with the BIOS teletype function (AH=0x0e) or on COM1
+%macro PUT_CHAR 0
+%ifdef SERIAL
+    call serial_char
+%else
+    int 0x10
+%endif
+%endmacro
+
 section .text               ; Code section
 
 start:
@@ -48,28 +80,131 @@ start:
 
     ; Display 'h'
     mov al, 'h'             ; Load ASCII value of 'h' into AL
-    int 0x10                ; BIOS interrupt to display character in AL
+    PUT_CHAR                ; BIOS interrupt to display character in AL
 
     ; Display 'e'
     mov al, 'e'             ; Load ASCII value of 'e' into AL
-    int 0x10                ; BIOS interrupt to display character in AL
+    PUT_CHAR                ; BIOS interrupt to display character in AL
 
     ; Display 'l'
     mov al, 'l'             ; Load ASCII value of 'l' into AL
-    int 0x10                ; BIOS interrupt to display character in AL
+    PUT_CHAR                ; BIOS interrupt to display character in AL
 
     ; Display 'l'
     mov al, 'l'             ; Load ASCII value of 'l' into AL
-    int 0x10                ; BIOS interrupt to display character in AL
+    PUT_CHAR                ; BIOS interrupt to display character in AL
 
     ; Display 'o'
     mov al, 'o'             ; Load ASCII value of 'o' into AL
-    int 0x10                ; BIOS interrupt to display character in AL
+    PUT_CHAR                ; BIOS interrupt to display character in AL
 
     ; Display '!'
     mov al, '!'             ; Load ASCII value of '!' into AL
-    int 0x10                ; BIOS interrupt to display character in AL
+    PUT_CHAR                ; BIOS interrupt to display character in AL
+
+%ifdef PROFILE
+    ; Display the time spent loading (from the load to the unpack timestamp)
+    mov si, load_label      ; Load the address of the label into SI
+    call print_string       ; Display the label
+    mov si, PROFILE_ADDR + PROFILE_SLOT ; Unpack timestamp
+    mov di, PROFILE_ADDR + 2 * PROFILE_SLOT ; Load timestamp
+    call print_delta        ; Display the difference
+
+    ; Display the time spent unpacking (from the unpack to the jump timestamp)
+    mov si, unpack_label    ; Load the address of the label into SI
+    call print_string       ; Display the label
+    mov si, PROFILE_ADDR    ; Jump timestamp
+    mov di, PROFILE_ADDR + PROFILE_SLOT ; Unpack timestamp
+    call print_delta        ; Display the difference
+%endif
+
+%ifdef SERIAL
+    ; End the line, so the output can be read line by line
+    mov al, 13
+    PUT_CHAR
+    mov al, 10
+    PUT_CHAR
+%endif
+
+%ifdef QEMU_EXIT
+    ; End QEMU, the exit status is (AL << 1) | 1
+    xor al, al
+    out 0xf4, al            ; isa-debug-exit device
+%endif
 
     ; Halt the CPU
     cli                     ; Disable interrupts to prevent further interrupt handling
-    hlt                     ; Halt the CPU indefinitely
\ No newline at end of file
+    hlt                     ; Halt the CPU indefinitely
+
+%ifdef SERIAL
+; Writes the character in AL to COM1, once the UART can take it
+serial_char:
+    push dx
+    push ax
+    mov dx, COM1_PORT + 5   ; Line status register
+.wait:
+    in al, dx
+    test al, 0x20           ; Wait for the transmit register to be empty
+    jz .wait
+    pop ax
+    mov dx, COM1_PORT
+    out dx, al              ; Write the character
+    pop dx
+    ret
+%endif
+
+%ifdef PROFILE
+; Displays the zero-terminated string at SI
+print_string:
+    lodsb                   ; Load the next character into AL
+    test al, al             ; Check for the end of the string
+    jz .done
+    mov ah, 0x0e            ; BIOS teletype function
+    PUT_CHAR                ; Display the character in AL
+    jmp print_string
+.done:
+    ret
+
+; Displays the timestamp at SI minus the timestamp at DI, as PROFILE_SLOT * 2 hex digits
+print_delta:
+    xor bx, bx              ; Subtract a word at a time, least significant first
+    mov cx, PROFILE_SLOT / 2
+    clc                     ; No borrow into the first word
+.subtract:
+    mov ax, [si + bx]
+    sbb ax, [di + bx]       ; Subtract with the borrow of the word below
+    mov [delta + bx], ax
+    inc bx                  ; Move to the next word (INC leaves the borrow in CF)
+    inc bx
+    loop .subtract
+.print:
+    dec bx                  ; Display the words most significant first
+    dec bx
+    mov ax, [delta + bx]
+    call print_hex
+    test bx, bx
+    jnz .print
+    ret
+
+; Displays AX as four hex digits
+print_hex:
+    mov cx, 4               ; Four digits, most significant first
+.digit:
+    rol ax, 4               ; Move the next digit into the low bits
+    push ax
+    and al, 0x0f
+    add al, '0'             ; Digits 0-9
+    cmp al, '9'
+    jbe .display
+    add al, 'a' - '9' - 1   ; Digits a-f
+.display:
+    mov ah, 0x0e            ; BIOS teletype function
+    PUT_CHAR                ; Display the digit in AL
+    pop ax
+    loop .digit
+    ret
+
+load_label   db " load ", 0 ; Label of the time spent loading
+unpack_label db " unpack ", 0 ; Label of the time spent unpacking
+delta times PROFILE_SLOT db 0 ; Difference between two timestamps
+%endif
\ No newline at end of file
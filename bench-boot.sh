@@ -0,0 +1,168 @@
+#!/bin/bash
+
+# bench-boot.sh
+#
+# This script benchmarks booting. It builds the bootloader for every read strategy, boots each
+# image headless in QEMU a number of times, with KVM (when available) and with TCG, and reports
+# the wall-clock time from starting QEMU to the application. The application is built to write
+# its output to COM1 and to end QEMU through the isa-debug-exit device, and the bootloader to
+# time its load and unpack phases with RDTSC, which the application reports along with it.
+#
+# Usage:
+#   ./bench-boot.sh [runs] [output file]         (defaults to 10 runs and bench-boot.json)
+#   PAD=<bytes> ./bench-boot.sh                  (random bytes after the application, default 131072)
+#   ACCELS="tcg" ./bench-boot.sh                 (accelerators to run with, default "kvm tcg")
+#
+# Note: Make sure the script is executable before running it:
+#   chmod +x bench-boot.sh
+#
+# Requirements:
+#   Ensure that NASM, GCC and QEMU are available, and /dev/kvm is accessible for KVM runs.
+#
+# Strategies:
+#   floppy-track      Floppy image, whole tracks per CHS read (the default bootloader)
+#   floppy-sector     Floppy image, a single sector per CHS read ('-DSECTOR_READS')
+#   hdd-lba           Hard disk image, up to 127 sectors per LBA read (the default bootloader)
+#   hdd-lba-sector    Hard disk image, a single sector per LBA read ('-DSECTOR_READS')
+#   hdd-chs           Hard disk image, whole tracks per CHS read ('-DNO_LBA')
+#   hdd-chs-sector    Hard disk image, a single sector per CHS read ('-DNO_LBA -DSECTOR_READS')
+#
+# The results are a JSON array with one object per strategy and accelerator: the number of runs
+# that reached the application, the minimum, median and mean wall-clock time in milliseconds,
+# and the median load and unpack times in time stamp counter cycles. The wall-clock time runs
+# from starting QEMU to its exit, so it includes QEMU's own start-up and the BIOS, which are the
+# same for every strategy; the cycle counts cover the bootloader alone.
+
+# File paths
+WORK="bench-boot"
+RUNS="${1:-10}"
+REPORT="${2:-bench-boot.json}"
+PAD="${PAD:-131072}"
+TIMEOUT=60
+FLAGS="-DPROFILE -DPROFILE_TSC"
+
+# Accelerators, KVM only if it can be used
+if [ -z "$ACCELS" ]; then
+    ACCELS="tcg"
+    if [ -w /dev/kvm ]; then
+        ACCELS="kvm tcg"
+    fi
+fi
+
+# Compile the packer, unless it is already built from this very source
+if [ -x packer ] && sha256sum --status -c packer.sha256 2> /dev/null; then
+    echo "Packer is up to date."
+else
+    echo "Compiling the packer..."
+    SOURCE_HASH=$(sha256sum packer.c | cut -d ' ' -f 1)   # Keys the packing cache, see packer.c
+    gcc -O2 -pthread -DPACKER_SOURCE="\"$SOURCE_HASH\"" packer.c -o packer || { echo "Packer compilation failed"; exit 1; }
+    sha256sum packer.c > packer.sha256
+fi
+
+# Assemble the application and append the padding, which makes the payload worth loading
+echo "Assembling the application..."
+mkdir -p "$WORK"
+nasm -f bin $FLAGS -DSERIAL -DQEMU_EXIT application.asm -o "$WORK/application.bin" || { echo "Application assembly failed"; exit 1; }
+if [ ! -f "$WORK/pad-$PAD.bin" ]; then
+    head -c "$PAD" /dev/urandom > "$WORK/pad-$PAD.bin"
+fi
+cat "$WORK/application.bin" "$WORK/pad-$PAD.bin" > "$WORK/payload.bin"
+
+# Builds the image of a strategy: <name> <floppy|hdd> <bootloader flags>
+build_image() {
+    local NAME=$1 DISK=$2 BOOT_FLAGS=$3
+    local GEOMETRY="18,2" HDD_OPTION=""
+    if [ "$DISK" = "hdd" ]; then
+        GEOMETRY="63,16"
+        HDD_OPTION="--hdd"
+    fi
+    nasm -f bin $FLAGS $BOOT_FLAGS boot.asm -o "$WORK/$NAME-boot.bin" || return 1
+    ./packer --codec lz --geometry "$GEOMETRY" "$WORK/payload.bin" "$WORK/$NAME-packed.bin" > /dev/null || return 1
+    ./packer --verify "$WORK/payload.bin" "$WORK/$NAME-packed.bin" > /dev/null || return 1
+    ./packer --image $HDD_OPTION "$WORK/$NAME-boot.bin" "$WORK/$NAME-packed.bin" "$WORK/$NAME.img" > /dev/null 2>&1
+}
+
+# Prints the median of the numbers on stdin
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { if (NR == 0) print 0; else if (NR % 2) print v[(NR + 1) / 2]; else print (v[NR / 2] + v[NR / 2 + 1]) / 2 }'
+}
+
+# Boots the image of a strategy RUNS times and prints its JSON object: <name> <floppy|hdd> <accelerator>
+bench_strategy() {
+    local NAME=$1 DISK=$2 ACCEL=$3
+    local DRIVE="-drive file=$WORK/$NAME.img,format=raw,if=floppy,index=0 -boot a"
+    if [ "$DISK" = "hdd" ]; then
+        DRIVE="-drive file=$WORK/$NAME.img,format=raw,if=ide,index=0 -boot c"
+    fi
+
+    : > "$WORK/times.txt"
+    : > "$WORK/phases.txt"
+    for RUN in $(seq "$RUNS"); do
+        local START END STATUS
+        START=$(date +%s%N)
+        timeout "$TIMEOUT" qemu-system-x86_64 -accel "$ACCEL" -display none -no-reboot -serial stdio \
+            -device isa-debug-exit,iobase=0xf4,iosize=0x04 $DRIVE > "$WORK/serial.txt" 2> /dev/null
+        STATUS=$?
+        END=$(date +%s%N)
+
+        # The application ends QEMU with status 1 ((0 << 1) | 1) once it has written its output
+        if [ "$STATUS" -eq 1 ] && grep -q "hello!" "$WORK/serial.txt"; then
+            echo $(( (END - START) / 1000 )) >> "$WORK/times.txt"
+            sed -n 's/.*load \([0-9a-f]*\) unpack \([0-9a-f]*\).*/\1 \2/p' "$WORK/serial.txt" >> "$WORK/phases.txt"
+        fi
+    done
+
+    local DONE MIN MEDIAN MEAN LOAD UNPACK
+    DONE=$(wc -l < "$WORK/times.txt")
+    MIN=$(sort -n "$WORK/times.txt" | head -n 1)
+    MEDIAN=$(median < "$WORK/times.txt")
+    MEAN=$(awk '{ s += $1 } END { print NR ? s / NR : 0 }' "$WORK/times.txt")
+    LOAD=$(while read -r L U; do echo $((16#$L)); done < "$WORK/phases.txt" | median)
+    UNPACK=$(while read -r L U; do echo $((16#$U)); done < "$WORK/phases.txt" | median)
+    awk -v name="$NAME" -v accel="$ACCEL" -v runs="$RUNS" -v done="$DONE" -v min="${MIN:-0}" \
+        -v median="$MEDIAN" -v mean="$MEAN" -v load="$LOAD" -v unpack="$UNPACK" 'BEGIN {
+        printf "    {\"strategy\": \"%s\", \"accel\": \"%s\", \"runs\": %d, \"completed\": %d,\n", name, accel, runs, done
+        printf "     \"wall_ms_min\": %.3f, \"wall_ms_median\": %.3f, \"wall_ms_mean\": %.3f,\n", min / 1000, median / 1000, mean / 1000
+        printf "     \"load_cycles_median\": %.0f, \"unpack_cycles_median\": %.0f}", load, unpack
+    }'
+}
+
+STRATEGIES=(
+    "floppy-track floppy"
+    "floppy-sector floppy -DSECTOR_READS"
+    "hdd-lba hdd"
+    "hdd-lba-sector hdd -DSECTOR_READS"
+    "hdd-chs hdd -DNO_LBA"
+    "hdd-chs-sector hdd -DNO_LBA -DSECTOR_READS"
+)
+
+# Build every image first, so the runs are not interleaved with builds
+echo "Building the images..."
+for STRATEGY in "${STRATEGIES[@]}"; do
+    read -r NAME DISK BOOT_FLAGS <<< "$STRATEGY"
+    build_image "$NAME" "$DISK" "$BOOT_FLAGS" || { echo "Building $NAME failed"; exit 1; }
+done
+
+# Run the benchmark
+echo "Booting every image $RUNS times with: $ACCELS..."
+FAILED=0
+FIRST=1
+{
+    echo "["
+    for ACCEL in $ACCELS; do
+        for STRATEGY in "${STRATEGIES[@]}"; do
+            read -r NAME DISK BOOT_FLAGS <<< "$STRATEGY"
+            [ "$FIRST" -eq 1 ] || echo ","
+            FIRST=0
+            bench_strategy "$NAME" "$DISK" "$ACCEL"
+            if [ "$(wc -l < "$WORK/times.txt")" -ne "$RUNS" ]; then
+                echo "Not every $NAME run reached the application with $ACCEL" >&2
+                FAILED=1
+            fi
+        done
+    done
+    echo
+    echo "]"
+} > "$REPORT"
+echo "Results written to $REPORT"
+exit $FAILED
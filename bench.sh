@@ -0,0 +1,63 @@
+#!/bin/bash
+
+# bench.sh
+#
+# This script benchmarks the packer. It builds a corpus of test inputs and runs every
+# compression backend and packing mode over it with 'packer --benchmark', which reports
+# encode and decode speed, compression ratio, sector count and peak memory as JSON.
+#
+# Usage:
+#   ./bench.sh [output file]                     (defaults to bench.json)
+#   KERNELS="/boot/vmlinuz-6.1.0" ./bench.sh     (kernel images to add to the corpus)
+#
+# Note: Make sure the script is executable before running it:
+#   chmod +x bench.sh
+#
+# Requirements:
+#   Ensure that NASM and GCC are available.
+#
+# Corpus (kept in bench-corpus/ so runs stay comparable, delete it to start over):
+#   application.bin   The application, assembled with NASM
+#   zeros.bin         1 MiB of zeros with a random 512-byte sector every 8 KiB (a sparse disk image)
+#   random.bin        256 KiB of random data, which does not compress
+#   kernels           The files in $KERNELS, or the readable /boot/vmlinuz-* images
+
+# File paths
+CORPUS="bench-corpus"
+REPORT="${1:-bench.json}"
+
+# Compile the packer, unless it is already built from this very source
+if [ -x packer ] && sha256sum --status -c packer.sha256 2> /dev/null; then
+    echo "Packer is up to date."
+else
+    echo "Compiling the packer..."
+    SOURCE_HASH=$(sha256sum packer.c | cut -d ' ' -f 1)   # Keys the packing cache, see packer.c
+    gcc -O2 -pthread -DPACKER_SOURCE="\"$SOURCE_HASH\"" packer.c -o packer || { echo "Packer compilation failed"; exit 1; }
+    sha256sum packer.c > packer.sha256
+fi
+
+# Build the corpus, the application is assembled every time
+echo "Building the benchmark corpus..."
+mkdir -p "$CORPUS"
+nasm -f bin application.asm -o "$CORPUS/application.bin" || { echo "Application assembly failed"; exit 1; }
+if [ ! -f "$CORPUS/zeros.bin" ]; then
+    for i in $(seq 128); do
+        head -c 7680 /dev/zero
+        head -c 512 /dev/urandom
+    done > "$CORPUS/zeros.bin"
+fi
+if [ ! -f "$CORPUS/random.bin" ]; then
+    head -c 262144 /dev/urandom > "$CORPUS/random.bin"
+fi
+
+INPUTS=("$CORPUS/application.bin" "$CORPUS/zeros.bin" "$CORPUS/random.bin")
+for KERNEL in ${KERNELS:-/boot/vmlinuz-*}; do
+    if [ -r "$KERNEL" ]; then
+        INPUTS+=("$KERNEL")
+    fi
+done
+
+# Run the benchmark
+echo "Benchmarking ${#INPUTS[@]} inputs..."
+./packer --benchmark "${INPUTS[@]}" > "$REPORT" || { echo "Benchmark failed"; exit 1; }
+echo "Results written to $REPORT"
@@ -21,10 +21,13 @@
 ;    - BIOS initializes segment registers unpredictably; set 'ds', 'es', and 'ss' to '0x0000', and 'sp' to '0x7c00'
 ;
 ; 4. Correct drive number handling:
-;    - Store the boot drive number from 'dl' (provided by BIOS) to correctly access the boot disk
+;    - Keep the boot drive number from 'dl' (provided by BIOS) to correctly access the boot disk,
+;      the loader leaves DL untouched for every disk call
 ;
 ; 5. Memory addressing for application:
-;    - Load the application to address '0x9000' and use a far jump ('jmp 0x0000:0x9000') to set 'cs' and 'ip' correctly
+;    - The payload is loaded at the sector aligned segment in its header (HDR_LOAD), far enough
+;      up that it ends the in-place margin past the unpacked application, and decoded in place to
+;      DECODE_ADDR ('0xa000'); a far jump ('jmp 0x0000:0xa000') then sets 'cs' and 'ip' correctly
 ;
 ; 6. Debugging with visual feedback:
 ;    - Displaying 'L', 'J', 'E', and 'U' for "Load", "Jump", "Error", and "Unpack" helps to track the bootloader’s progress
@@ -36,7 +39,15 @@
 ; - Write the assembled bootloader to the first sector of a floppy image using a script or direct dd command:
 ;     dd if=boot.bin of=floppy.img bs=512 count=1 conv=notrunc
 ;
-; - This bootloader expects an application to be placed in the second sector of the floppy (offset 0x200)
+; - This bootloader expects a directory in the second sector of the floppy (offset 0x200), followed
+;   by one or more packed applications, each starting with the payload header written by the packer
+;   (makefloppy.sh lays them out)
+;
+; - Or assemble it as the second stage of the two-stage loader (see stage1.asm), which follows
+;   the directory on the disk:
+;     nasm -f bin -DSTAGE2 boot.asm -o stage2.bin
+;   or with the 32-bit protected mode decoder:
+;     nasm -f bin -DSTAGE2 -DPMODE boot.asm -o stage2.bin
 ;
 ; Example QEMU Test:
 ; - To test with QEMU, run:
@@ -44,8 +55,27 @@
 ; 
 ; Features:
 ; - Initializes stack and segment registers for predictable behavior
-; - Displays debug characters ('L', 'J', 'E', and 'U') for "Load," "Jump,", "Error", and "Unpack" stages
-; - Loads application to memory address '0x9000'
+; - Displays debug characters ('L', 'J', 'E', and 'U') for "Load," "Jump,", "Error", and "Unpack" stages,
+;   on screen or ('-DSERIAL') on COM1
+; - Loads application a whole track per BIOS call at the tail of the memory it unpacks to,
+;   from '0xa000' on, and unpacks it in place, stepping segments to get past 64 KiB
+; - Reads by LBA (INT 13h extensions, up to 127 sectors per call) when the BIOS supports it,
+;   for USB and hard disk emulation, and by CHS otherwise
+; - Takes the payload sector count and disk geometry from the payload header
+; - Boots the application selected in the directory sector of a disk holding several of them
+; - Decodes payloads packed as independent blocks (block-parallel packer) block by block,
+;   each one as soon as it is loaded, in between the track reads
+; - Retries failed reads after a disk reset, halving the read size each time
+; - Specialized build for a single payload ('nasm -p' with the include of 'packer --format')
+;   that leaves out the decoder paths the payload does not use
+; - Checks the unpacked application against a checksum in the payload header, summed while
+;   decoding (two additions per byte written), and stops with 'E' on a mismatch
+; - Profiling build ('-DPROFILE', with '-DPROFILE_TSC' for RDTSC) that timestamps the load, unpack
+;   and jump phases for the application to display
+; - Second stage build ('-DSTAGE2') for the two-stage loader, loaded by stage1.asm, with
+;   room for an RLE run decoder that writes a whole run at once
+; - Protected mode build ('-DSTAGE2 -DPMODE') that enables A20 and decodes the loaded payload
+;   with a 32-bit decoder over flat memory, then returns to real mode for the application
 ; - Pads the boot sector to 512 bytes and includes the 0xaa55 boot signature
 ; 
 ; MIT License:
@@ -71,18 +101,159 @@
 ; SOFTWARE.
 
 bits 16                     ; Instruct NASM that this is 16 bit (real mode) code
+
+; Second stage build (-DSTAGE2): the loader runs as the second stage of stage1.asm,
+; which loads it right after the directory sector and has read that sector already.
+; It is not limited to the boot sector, so it also decodes RLE runs with 'rep stosb'
+; and sums them in closed form instead of a byte at a time.
+%define DIRECTORY_ADDR 0x7e00 ; Directory sector as the first stage leaves it
+%define STAGE2_ADDR    0x8000 ; Second stage, right after the directory
+%define STAGE2_VARS    (4 + SECTOR_SIZE) ; Second stage variables after its sectors ('.bss' below)
+; Most second stage sectors that leave room for the variables below the decoder output at
+; DECODE_ADDR (0xa000): 14. The packer (STAGE2_MAX_SECTORS in packer.c) and stage1.asm
+; take the same limit, and the build stops if the second stage or its variables outgrow it
+%define STAGE2_MAX_SECTORS ((DECODE_ADDR - STAGE2_ADDR - STAGE2_VARS) / SECTOR_SIZE)
+%ifdef STAGE2
+org STAGE2_ADDR             ; Origin where the first stage loads the second stage
+%else
 org 0x7c00                  ; Origin where BIOS loads the bootloader
+%endif
+
+; Protected mode build (-DSTAGE2 -DPMODE): once the whole payload is loaded, the second
+; stage enables the A20 line, switches to 32-bit protected mode and decodes every block
+; over flat memory, with no segments to step, then returns to real mode for the checksum
+; and the jump. The application still runs in real mode, and the BIOS still reads below
+; 1 MiB, so the payload has to fit there as before.
+%ifdef PMODE
+%ifndef STAGE2
+%error "PMODE needs STAGE2, the boot sector has no room for the 32-bit decoder"
+%endif
+%endif
+%define CODE32_SEL     0x08 ; GDT selector: flat 32-bit code
+%define DATA32_SEL     0x10 ; GDT selector: flat 32-bit data
+%define CODE16_SEL     0x18 ; GDT selector: 16-bit code, 64 KiB at 0 (back to real mode)
+%define DATA16_SEL     0x20 ; GDT selector: 16-bit data, 64 KiB at 0 (real mode limits)
 
-%define LOAD_ADDR   0x9000  ; Destination address for our compressed application
+%define SECTOR_SIZE 512     ; Size of a disk sector
 %define DECODE_ADDR 0xa000  ; Destination address for our unpacked application
-%define XOR_KEY     0x69    ; XOR decryption key
+%define STEP_LIMIT  0x8000  ; Offsets this high move to the next segment while decoding (top bit)
+%define STEP_SIZE   0x4000  ; Bytes moved from the offset into the segment per step
+; Read strategies for comparing loaders (see bench-boot.sh): -DNO_LBA reads by CHS even
+; with INT 13h extensions, -DSECTOR_READS a single sector per read instead of whole tracks
+; (or LBA_SECTORS)
+%ifdef SECTOR_READS
+%define LBA_SECTORS 1       ; A single sector per extended read
+%else
+%define LBA_SECTORS 127     ; Most sectors per extended read (fits a 64 KiB segment and every BIOS)
+%endif
+%define READ_RETRIES 5      ; Single sector read retries before giving up
+
+%define HEADER_VERSION 8    ; Payload header version written by the packer
+%define HEADER_SIZE    14   ; Payload header size, the block index follows the header
+%define HDR_VERSION    0    ; Header offset: header version (byte)
+%define HDR_SPT        1    ; Header offset: sectors per track (byte)
+%define HDR_HEADS      2    ; Header offset: number of heads (byte)
+%define HDR_CODEC      3    ; Header offset: codec of every block, 0xff if they differ (byte)
+%define HDR_SECTORS    4    ; Header offset: total payload sectors, header sector included (word)
+%define HDR_BLOCKS     6    ; Header offset: number of packed blocks, 1 for a single stream (word)
+%define HDR_MARGIN     8    ; Header offset: in-place safety margin in bytes (word)
+%define HDR_LOAD       10   ; Header offset: load segment, sector aligned (word)
+%define HDR_CHECKSUM   12   ; Header offset: checksum seed, summed to zero by the decoder (word)
+
+%define CODEC_RLE      0    ; Escape-coded RLE, decoded by 'unpack_block'
+%define CODEC_LZ       1    ; LZSS, decoded by 'unpack_lz'
+%define CODEC_STORED   2    ; RLE literal blocks only, decoded by 'unpack_block' as well
+%define LZ_MIN_MATCH   3    ; Shortest LZSS match
+
+; Payload format: assembled with the include 'packer --format' writes for a payload
+; ('nasm -p application-format.inc'), the bootloader decodes only that payload's
+; codec and the tokens that occur in it, and takes its geometry, sector count and
+; a single block as constants instead of reading them from the header. Without it
+; every format is decoded, and a zero below stands for "read from the header".
+%ifndef FORMAT_CODEC
+%define FORMAT_CODEC        -1   ; Either codec, from each block
+%define FORMAT_XOR_KEY      0x69 ; XOR encryption key of the packer
+%define FORMAT_SECTORS      0    ; Payload sectors, from the header
+%define FORMAT_SPT          0    ; Sectors per track, from the header
+%define FORMAT_HEADS        0    ; Number of heads, from the header
+%define FORMAT_BLOCKS       0    ; Number of blocks, from the header
+%define FORMAT_RUNS         1    ; Every RLE and LZSS token can occur
+%define FORMAT_LITERALS     1
+%define FORMAT_LONG_MATCHES 1
+%endif
+%define XOR_KEY FORMAT_XOR_KEY  ; XOR decryption key
+
+; Profiling build (-DPROFILE): every phase pushes a timestamp, which leaves them
+; at fixed addresses under the initial stack for the application to read, the
+; newest lowest: load (PROFILE_ADDR + 2 * PROFILE_SLOT), unpack (PROFILE_ADDR +
+; PROFILE_SLOT) and jump (PROFILE_ADDR). The time is the low word of the BIOS tick
+; count at 0x46c (about 18.2 per second), or with -DPROFILE_TSC the time stamp
+; counter (RDTSC, a Pentium or later).
+%ifdef PROFILE_TSC
+%define PROFILE_SLOT   8    ; Size of a timestamp: the time stamp counter (qword)
+%else
+%define PROFILE_SLOT   2    ; Size of a timestamp: low word of the BIOS tick count
+%endif
+%define PROFILE_ADDR   (0x7c00 - 3 * PROFILE_SLOT) ; Timestamps of the jump, unpack and load phases
+
+; Debug build (-DDEBUG): every phase displays a character with the BIOS teletype
+; function, or with -DSERIAL writes it straight to the COM1 UART, which is faster,
+; keeps INT 10h out of the profiled phases and shows up on QEMU's '-serial stdio'.
+; There is no room to program the UART or to wait for its transmitter, so this
+; relies on the BIOS (or QEMU) having set COM1 up, and on the phases being apart.
+%define COM1_PORT      0x3f8 ; COM1 transmit register
+
+%macro DEBUG_CHAR 1
+%ifdef DEBUG
+%ifdef SERIAL
+    mov al, %1              ; Write the character to COM1
+    mov dx, COM1_PORT
+    out dx, al
+%else
+    mov ax, 0x0e00 | %1     ; BIOS teletype function (AH=0x0e), character in AL
+    int 0x10                ; Display the character
+%endif
+%endif
+%endmacro
+
+; Writes a run of CL (1-127, CH zero) bytes AL to ES:DI at once, and adds it to the
+; checksums in closed form: n copies of v add n * v to BL, and n * BL + v * n * (n + 1) / 2
+; to BH (modulo 256). Clobbers AX, CX and DX. The same code runs in the 32-bit decoder
+; (see 'unpack_protected'), where 'rep stosb' takes ECX and EDI.
+%macro STORE_RUN 0
+    mov dl, cl              ; Keep the run length n
+    rep stosb               ; Write the run to memory at ES:DI (CX ends zero)
+    xchg ax, dx             ; AL = n, DL = v
+    mov dh, al              ; DH = n
+    mul bl                  ; n * BL
+    add bh, al
+    mov al, dh
+    inc ax                  ; n + 1 (at most 128, in AL)
+    mul dh                  ; n * (n + 1)
+    shr ax, 1
+    mul dl                  ; v * n * (n + 1) / 2
+    add bh, al
+    mov al, dh
+    mul dl                  ; n * v
+    add bl, al
+%endmacro
+
+%macro PROFILE_STAMP 0
+%ifdef PROFILE
+%ifdef PROFILE_TSC
+    rdtsc                   ; Push the time stamp counter (EDX:EAX)
+    push edx
+    push eax
+%else
+    push word [0x46c]       ; Push the BIOS tick count (low word)
+%endif
+%endif
+%endmacro
 
 section .text               ; Code section
 
 start:
-    mov [boot_drive], dl    ; Store the boot drive number from BIOS
-
-    ; Setup segments and stack
+    ; Setup segments and stack, DL keeps the boot drive number from BIOS
     cli                     ; Disable interrupts
     xor ax, ax              ; Zero out AX
     mov ds, ax              ; Set DS (data segment) to 0x0000
@@ -90,109 +261,763 @@ start:
     mov ss, ax              ; Set SS (stack segment) to 0x0000
     mov sp, 0x7c00          ; Set SP (stack pointer) to 0x7c00 (stack grows downwards)
     sti                     ; Enable interrupts
+    cld                     ; String instructions move forward
 
-%ifdef DEBUG
     ; Display 'L' for loading stage
-    mov ah, 0x0e            
-    mov al, 'L'             
-    int 0x10                ; Display 'L' to confirm load phase
+%ifdef SERIAL
+    push dx                 ; The COM1 port goes in DX, keep the boot drive number
+%endif
+    DEBUG_CHAR 'L'
+%ifdef SERIAL
+    pop dx
+%endif
+%ifdef PROFILE_TSC
+    mov bx, dx              ; RDTSC overwrites the boot drive number in DL
+%endif
+    PROFILE_STAMP
+%ifdef PROFILE_TSC
+    mov dx, bx
 %endif
 
-    ; Load the main application from sector 1 (0-based) of the floppy disk
-    mov ah, 0x02            ; BIOS function to read sectors
-    mov al, 0x01            ; Number of sectors to read (1), updated depending on application size
-    mov ch, 0x00            ; Cylinder number (0)
-    mov cl, 0x02            ; Sector number (2 in 1-based indexing) <!-- IMPORTANT!
-    mov dh, 0x00            ; Head number (0)
-    mov dl, [boot_drive]    ; Boot drive number (passed by BIOS)
-    mov bx, LOAD_ADDR       ; Destination memory for the read
-    int 0x13                ; Interrupt to read sector
+    ; Load the selected packed application from the disk, decoding every block as soon as
+    ; it is loaded ('load' runs on to 'loaded')
 
-    jc error                ; Jump to 'error' if reading failed
+;------------------------------------------------------------------------------
+; Load - Reads the packed application from disk into the tail of its destination
+;
+; The disk can hold several packed applications (one per hardware variant, say),
+; listed in the directory sector that follows the boot sector (see makefloppy.sh).
+; The directory starts with a copy of the entry of the application to boot, the
+; one makefloppy.sh selected: its first sector by LBA and as CX and DH for a CHS
+; read. Only that application is loaded, the directory sector is the one extra
+; read. Directory layout:
+;   offset 0: LBA of the application to boot (word)
+;   offset 2: its cylinder and sector, as CX for a CHS read (word)
+;   offset 4: its head (byte)
+;   offset 5: number of entries (byte)
+;   offset 6: index of the application to boot (byte)
+;   offset 7: number of second stage sectors, 0 without one (byte, see stage1.asm)
+;   offset 8: one entry per application, 8 bytes each: LBA (word), CHS as CX (word),
+;             head (byte), codec (byte) and number of sectors (word)
+;
+; The payload starts with a header written by the packer, holding the number of
+; payload sectors, the disk geometry and where to load the payload. The first
+; sector is read on its own into 'header', then copied to the load position, the
+; sector aligned segment HDR_LOAD. The packer places the payload so that it ends
+; at least the in-place margin (HDR_MARGIN) past the end of the unpacked
+; application, which keeps the decoder writing behind what it still has to read.
+; The rest of the payload is then read a whole track per BIOS call, stepping to
+; the next head and cylinder as each track is used up. If the BIOS supports INT 13h
+; extensions (USB and hard disk emulation) the rest is instead read by LBA, up to
+; LBA_SECTORS per call, which needs no geometry at all.
+;
+; Registers used:
+;   - ES:BX: Destination for the next read (ES is advanced past every read, BX
+;            is 0x0200 after the first sector)
+;   - CH: Cylinder of the next read (bits 0-7, the packer keeps every payload
+;         below cylinder 256, see MAX_CHS_CYLINDER in packer.c)
+;   - CL: Sector of the next read (1-based, cylinder bits 8-9 always clear)
+;   - DH: Head of the next read
+;   - DL: Boot drive number
+;   - DI: Number of sectors left to read
+;   - AL: Number of sectors in the current read
+;   - BP: 0x4000 if reading by LBA ('dap' holds the LBA of the next read)
+;
+; Process:
+;   1. Probe for INT 13h extensions with AH=41h
+;   2. Read the directory sector and take the position of the application to boot
+;   3. Read the first payload sector, check the header version and copy the sector
+;      to the load position
+;   4. Decode every block that is completely loaded (see 'unpack_ready')
+;   5. With extensions, read the rest of the payload, LBA_SECTORS at most, and repeat
+;   6. Otherwise, if the current track is used up, move to the next head (and cylinder)
+;   7. Read the rest of the track, or fewer sectors if the payload ends sooner
+;   8. Repeat until all payload sectors are read, then go on to 'loaded'
+;------------------------------------------------------------------------------
+load:
+    xor bp, bp              ; Read by CHS unless the BIOS has INT 13h extensions
+%ifndef NO_LBA
+    mov ah, 0x41            ; Check for INT 13h extensions
+    mov bx, 0x55aa
+    int 0x13
+    jc load_header          ; Not supported, read by CHS
+    cmp bx, 0xaa55
+    jne load_header
+    shr cx, 1               ; Bit 0 is set if extended reads (AH=42h) are supported
+    jnc load_header
+    mov bp, 0x4000          ; Read by LBA, BP turns AH=02h into AH=42h (see 'read_track')
+%endif
 
-%ifdef DEBUG
-    ; Display 'U' for unpack stage
-    mov ah, 0x0e
-    mov al, 'U'
-    int 0x10
+load_header:
+%ifdef STAGE2
+    mov si, DIRECTORY_ADDR  ; The first stage read the directory already, it starts with the entry to boot:
+%else
+    mov bx, header          ; ES:BX points to 'header'
+    mov cx, 0x0002          ; Cylinder 0 (CH), sector 2 in 1-based indexing (CL) <!-- IMPORTANT!
+    xor dh, dh              ; Head 0
+
+    mov ax, 0x0201          ; Read (AH=02h) the directory sector (AL) into 'header'
+    call read_sectors
+
+    mov si, bx              ; The directory starts with the entry to boot:
 %endif
+    lodsw                   ; its LBA,
+    mov [dap_lba], ax
+    lodsw                   ; its cylinder and sector (CX for a CHS read)
+    xchg ax, cx
+    lodsb                   ; and its head
+    mov dh, al
 
-    ; Call 'unpack' to decrompress and decrypt
-    call unpack
+%ifdef STAGE2
+    mov bx, header          ; ES:BX points to 'header'
+%else
+    mov bx, header - SECTOR_SIZE ; ES:BX points to 'header', ES moved on past the directory
+%endif
+    mov ax, 0x0201          ; Read (AH=02h) only the first payload sector (AL), it holds the header
+    call read_sectors
 
-%ifdef DEBUG
-    ; Display 'J' for jump stage
-    mov ah, 0x0e
-    mov al, 'J'
-    int 0x10                ; Display 'J' before jumping to application
+    cmp byte [header + HDR_VERSION], HEADER_VERSION
+    jne error               ; Jump to 'error' if the payload was packed for another loader
+
+    mov es, [header + HDR_LOAD] ; ES points to the load position
+    push cx
+    mov si, header          ; Copy the first sector there, the packed data goes on in it
+    xor di, di
+    mov cx, SECTOR_SIZE / 2
+    rep movsw
+    pop cx
+    mov bx, di              ; ES:BX points past the first sector, the rest is read there
+
+%if FORMAT_BLOCKS == 1
+    mov word [unpack_src], HEADER_SIZE + 4 ; A single stream starts after the header and its index
+%else
+    mov ax, [header + HDR_BLOCKS]
+    shl ax, 1               ; Size of the block index, its terminator included
+    add ax, HEADER_SIZE + 2
+    mov [unpack_src], ax    ; Compressed data starts after the header and the block index
 %endif
+    mov [unpack_src + 2], es
 
-    ; Far jump to application loaded at DECODE_ADDR
-    jmp 0x0000:DECODE_ADDR  ; Set CS and IP correctly with far jump
+%if FORMAT_SECTORS
+    mov di, FORMAT_SECTORS - 1 ; Sectors left to read, the header sector is already loaded
+%else
+    mov di, [header + HDR_SECTORS]
+    dec di                  ; Sectors left to read, the header sector is already loaded
+%endif
+
+next_track:
+    test di, di             ; Check for end of payload
+    jz loaded               ; If zero, loading is complete
+
+%if FORMAT_BLOCKS != 1
+%ifndef PMODE
+    call unpack_ready       ; Decode the blocks loaded so far, the disk keeps turning meanwhile
+%endif                      ; (a single stream is only ready once it is all loaded, and the
+%endif                      ; protected mode decoder runs once everything is)
+
+    mov ax, LBA_SECTORS     ; Read as much as a single extended read allows
+    test bp, bp             ; with INT 13h extensions
+    jnz read_size
+
+%if FORMAT_SPT
+    mov al, FORMAT_SPT      ; Otherwise read the rest of the track (AH is zero)
+%else
+    mov al, [header + HDR_SPT] ; Otherwise read the rest of the track (AH is zero)
+%endif
+    cmp cl, al              ; Check if the current track is used up
+    jbe same_track
+
+    mov cl, 0x01            ; Continue at sector 1 of the next track
+    inc dh                  ; Move to the next head
+%if FORMAT_HEADS
+    cmp dh, FORMAT_HEADS
+%else
+    cmp dh, [header + HDR_HEADS]
+%endif
+    jb same_track
+    xor dh, dh              ; Wrap to head 0 and move to the next cylinder
+    inc ch                  ; (never past 255, bits 8-9 of CL stay clear, see 'load')
+
+same_track:
+%ifdef SECTOR_READS
+    mov al, 1               ; A single sector
+%else
+    inc al
+    sub al, cl              ; Sectors left on this track
+%endif
+
+read_size:
+    cmp ax, di              ; Check if the payload ends sooner
+    jbe read_track
+    mov ax, di              ; If so, read only the remaining sectors
+
+read_track:
+    mov [dap_count], ax     ; Fill in the disk address packet, unused for CHS reads
+    mov [dap_segment], es
+    mov si, dap
+    mov ah, 0x02            ; BIOS function to read sectors
+    or ax, bp               ; or to read sectors by LBA (AH=42h)
+    call read_sectors
+    jmp next_track
 
 error:
-%ifdef DEBUG
     ; Display 'E' for error
-    mov ah, 0x0e
-    mov al, 'E'
-    int 0x10                ; Display error indicator
-%endif
+    DEBUG_CHAR 'E'
 
 halt_loop:
     hlt                     ; Halt in case of error
     jmp halt_loop           ; Infinite loop on error
 
+loaded:
+    push ds                 ; Restore ES (0x0000)
+    pop es
+
+    ; Display 'U' for unpack stage
+    DEBUG_CHAR 'U'
+    PROFILE_STAMP
+
+%ifdef PMODE
+    ; Call 'unpack_protected' to decompress and decrypt every block in protected mode
+    call unpack_protected
+%else
+    ; Call 'unpack_ready' to decrompress and decrypt what could not be decoded while loading
+    call unpack_ready       ; DI is zero, every block is loaded
+%endif
+
+    ; Check the unpacked application, both checksums end at zero
+    cmp word [header + HDR_CHECKSUM], 0
+    jne error               ; Jump to 'error' if the application is corrupt
+
+    ; Display 'J' before jumping to application
+    DEBUG_CHAR 'J'
+    PROFILE_STAMP
+
+    ; Far jump to application loaded at DECODE_ADDR
+    jmp 0x0000:DECODE_ADDR  ; Set CS and IP correctly with far jump
+
 ;------------------------------------------------------------------------------
-; Unpack - Decompresses and decrypts the loaded application data
+; Read sectors - Reads AL sectors at CH/CL/DH into ES:BX and advances past them
+;
+; AH is the BIOS function, AH=02h for a CHS read, or AH=42h for an extended read
+; of the sectors given in 'dap' (DS:SI). On return CL is the sector following the
+; read, ES points past the data read, 'dap' holds the LBA following the read, and
+; DI has been decremented by the number of sectors read.
+;
+; A failed read is retried after a disk reset (AH=00h), drives often fail the
+; first reads while the motor spins up. Each retry reads half as many sectors,
+; which gets a read past the limits some BIOSes have (a read must not cross a
+; 64 KiB DMA boundary, or on some a track). Single sector reads are retried
+; READ_RETRIES times in all before jumping to 'error'.
+;------------------------------------------------------------------------------
+read_sectors:
+    push ax                 ; Keep the sector count, not every BIOS returns it in AL
+    int 0x13                ; Interrupt to read sectors
+    pop ax
+    jnc read_done
+
+    push ax
+    cbw                     ; Reset the disk system (AH=00h, AL is at most 127)
+    int 0x13
+    pop ax
+    shr al, 1               ; Retry with half the sectors
+    jnz read_retry
+    inc ax                  ; A single sector again, which counts as a retry
+    dec byte [read_retries]
+    js error                ; Jump to 'error' if reading keeps failing
+read_retry:
+    mov [dap_count], al
+    jmp read_sectors
+
+read_done:
+    add cl, al              ; Next sector on this track
+    cbw                     ; (AL is at most 127)
+    add [dap_lba], ax       ; Next sector by LBA
+    sub di, ax              ; Fewer sectors left to read
+    shl ax, 5               ; Sectors to paragraphs (512 / 16)
+    mov si, es
+    add si, ax
+    mov es, si              ; Advance ES past the sectors just read
+    ret
+
+;------------------------------------------------------------------------------
+; Unpack protected - Decodes every block in 32-bit protected mode (-DPMODE)
+;
+; Called by 'loaded' once the whole payload is loaded. Enables the A20 line with
+; the fast A20 gate (port 0x92) so that memory past 1 MiB is not wrapped around,
+; loads a GDT of flat 4 GiB segments and switches to protected mode. The 32-bit
+; decoders then run over flat memory from the linear address of the compressed
+; data to DECODE_ADDR, every block after the one before it, with 32-bit pointers
+; that need no segment stepping. The checksums are kept in the header as in real
+; mode, and the way back goes through 16-bit segments of 64 KiB, which leave the
+; limits real mode expects, before PE is cleared. Interrupts stay disabled while
+; in protected mode, there is no IDT (so the BIOS tick count stands still). All
+; registers are preserved, the segment registers are 0x0000 on return.
+;------------------------------------------------------------------------------
+%ifdef PMODE
+unpack_protected:
+    pusha
+
+    in al, 0x92             ; Enable the A20 line (System Control Port A)
+    or al, 0x02             ; Bit 1: A20 enabled
+    and al, 0xfe            ; Bit 0 would reset the machine
+    out 0x92, al
+
+    cli                     ; Disable interrupts, protected mode has no IDT to take them
+    movzx esp, sp           ; The 32-bit code addresses the stack by ESP (SS is 0x0000)
+    lgdt [gdt_descriptor]   ; Load the GDT of flat segments
+    mov eax, cr0
+    or al, 1                ; Set PE (protection enable)
+    mov cr0, eax
+    jmp CODE32_SEL:protected_entry ; Far jump to load CS with the 32-bit code segment
+
+bits 32
+protected_entry:
+    mov ax, DATA32_SEL      ; Flat data segments, based at 0 like the real mode ones
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+
+    movzx esi, word [unpack_src + 2] ; Linear address of the compressed data
+    shl esi, 4
+    movzx eax, word [unpack_src]
+    add esi, eax
+    mov edi, DECODE_ADDR    ; Linear address of the decompressed data
+    mov bx, [header + HDR_CHECKSUM] ; Checksums of the output so far
+    movzx ebp, word [header + HDR_BLOCKS] ; Blocks to decode, back to back in the stream
+
+protected_block:
+    call unpack_block32
+    dec ebp
+    jnz protected_block
+
+    mov [header + HDR_CHECKSUM], bx
+    jmp CODE16_SEL:protected_exit ; Far jump to a 16-bit code segment before leaving
+
+bits 16
+protected_exit:
+    mov ax, DATA16_SEL      ; 64 KiB data segments, the limits real mode expects
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    mov eax, cr0
+    and al, 0xfe            ; Clear PE, back to real mode
+    mov cr0, eax
+    jmp 0x0000:real_entry   ; Far jump to reload CS with a real mode segment
+
+real_entry:
+    xor ax, ax              ; Restore DS, ES and SS (0x0000)
+    mov ds, ax
+    mov es, ax
+    mov ss, ax
+    sti                     ; Enable interrupts
+
+    popa
+    ret
+
+;------------------------------------------------------------------------------
+; Unpack block 32 - Decompresses and decrypts one block in protected mode
+;
+; The 32-bit counterpart of 'unpack_block' and 'unpack_lz', for the same encoding
+; and checksums, with ESI and EDI as flat pointers into memory (DS and ES are the
+; flat data segment). String instructions and 'loop' take ESI, EDI and ECX here.
+;
+; Registers used:
+;   - ESI: Source pointer (compressed and encrypted data), left after the end marker
+;   - EDI: Destination pointer (decompressed data), left after the decoded block
+;   - ECX: Number of bytes to write, or the length of the current match
+;   - DX: Run length and byte of a run, or the LZSS flag bits
+;   - BL, BH: Checksums of the output so far
+;------------------------------------------------------------------------------
+bits 32
+unpack_block32:
+    lodsb                   ; Load the codec of the block
+%if FORMAT_CODEC < 0
+    cmp al, CODEC_LZ
+    je unpack_lz32          ; Use the LZSS decoder if the block was packed with it
+%endif
+%if FORMAT_CODEC != CODEC_LZ
+    xor ecx, ecx            ; Counts fit in CL, and every loop below leaves ECX zero
+
+next32:
+    lodsb                   ; Load the control byte into AL
+    test al, al             ; Check for end of data
+    jz done32               ; If zero, end unpacking
+
+    mov cl, al              ; Store the count in CL
+    js literal32            ; Top bit set (from 'test'), a literal block
+
+    lodsb                   ; Load the byte to repeat
+    xor al, XOR_KEY         ; Decrypt the byte using XOR
+    STORE_RUN               ; Write the whole run at once
+    jmp next32              ; Move to the next block of RLE data
+
+literal32:
+    and cl, 0x7f            ; Number of literal bytes that follow
+
+copy32:
+    lodsb                   ; Load the next literal byte
+    xor al, XOR_KEY         ; Decrypt the byte using XOR
+    stosb                   ; Write the decrypted byte to memory at EDI
+    add bl, al              ; Add it to the checksums
+    add bh, bl
+    loop copy32             ; Copy until count reaches zero
+    jmp next32              ; Move to the next block of RLE data
+
+done32:
+    ret                     ; Return to caller (block complete)
+%endif
+
+%if FORMAT_CODEC != CODEC_RLE
+unpack_lz32:
+    lodsb                   ; Load the flag byte of the next group
+    mov ah, 1               ; Above a marker bit that ends the group
+    xchg ax, dx
+
+lz32_token:
+    shr dx, 1               ; Move the flag of the next token into CF
+    jz unpack_lz32          ; Only the marker bit left, move to the next group
+    jnc lz32_match          ; If zero, the token is a match
+
+    lodsb                   ; Load the literal byte
+    xor al, XOR_KEY         ; Decrypt the byte using XOR
+    stosb                   ; Write the decrypted byte to memory at EDI
+    add bl, al              ; Add it to the checksums
+    add bh, bl
+    jmp lz32_token
+
+lz32_match:
+    movzx eax, word [esi]   ; Load the match word
+    add esi, 2
+    mov ecx, eax
+    and eax, 0x0fff         ; Offset back into the output
+    jz lz32_done            ; If zero, end unpacking
+    shr ecx, 12             ; Length minus LZ_MIN_MATCH
+    cmp cl, 15              ; Check for an extra length byte
+    jne lz32_copy
+    add cl, [esi]           ; Add the extra length byte
+    adc ch, ch              ; (CH is zero)
+    inc esi
+
+lz32_copy:
+    add ecx, LZ_MIN_MATCH
+    push esi
+    mov esi, edi
+    sub esi, eax            ; Source of the match in the decompressed data
+
+lz32_byte:
+    lodsb                   ; Copy the match byte by byte, so overlapping copies repeat
+    stosb
+    add bl, al              ; Add it to the checksums
+    add bh, bl
+    loop lz32_byte
+    pop esi
+    jmp lz32_token
+
+lz32_done:
+    ret                     ; Return to caller (block complete)
+%endif
+bits 16
+%else
+
+;------------------------------------------------------------------------------
+; Unpack ready - Decodes every block that has been loaded completely
+;
+; The packed and encrypted data is loaded into memory at the load position by the
+; bootloader and is unpacked to DECODE_ADDR, ready for execution. The payload is
+; packed as one or more blocks (more with packer '--threads'), every block ending
+; with its own end marker, and the header is followed by a block index with one
+; word per block: the number of sectors still to be read once the block is loaded
+; completely, so a block is ready as soon as DI is down to its entry. A single
+; stream is one block with an entry of 0, and the index ends with 0xffff (-1),
+; which DI never gets down to. The index is read from 'header', as the decoder
+; soon overwrites the copy at the load position. The decoder state is kept in
+; memory as far pointers (offset, segment) so that 'load' can decode block by
+; block in between its reads, and what is left is decoded once 'load' is done.
+;
+; Called by 'load' between its reads, and by 'start' once the whole payload is
+; loaded (DI is zero). INT 13h returns only once a read is done, so reading and
+; decoding cannot run at the same time, but a track read first waits for its
+; sector to come round under the head: a block decoded in between mostly uses up
+; time the next read would otherwise spend waiting. All registers are preserved.
+;------------------------------------------------------------------------------
+unpack_ready:
+    pusha
+
+    mov si, [unpack_index]
+    lodsw                   ; Sectors left to read once the next block is loaded
+    cmp di, ax              ; (signed, the terminator is never ready)
+    jg ready_done           ; Not loaded completely yet
+
+    mov [unpack_index], si
+    call unpack_next
+    popa                    ; Restore DI, the decoder moved it, and check the next block
+    jmp unpack_ready
+
+ready_done:
+    popa
+    ret
+
+;------------------------------------------------------------------------------
+; Unpack next - Decodes the next block from the decoder state
+;
+; Keeps the decoder state for the block after it, and the checksums of the output
+; so far in the header (see 'unpack_block'). ES is preserved, and DS is expected
+; to be 0x0000 (as it always is outside the decoders) and left so.
+;------------------------------------------------------------------------------
+unpack_next:
+    push es
+    mov bx, [header + HDR_CHECKSUM] ; Checksums of the output so far
+    les di, [unpack_dst]    ; Set destination pointer to decompressed data
+    lds si, [unpack_src]    ; Set source pointer to compressed data (DS last, it addresses the variables)
+    call unpack_block
+    push ds
+    push ss                 ; Restore DS (0x0000)
+    pop ds
+    mov [header + HDR_CHECKSUM], bx
+    mov [unpack_src], si    ; Keep the decoder state for the next block
+    pop word [unpack_src + 2]
+    mov [unpack_dst], di
+    mov [unpack_dst + 2], es
+    pop es
+    ret
+
+;------------------------------------------------------------------------------
+; Step segments - Moves DS:SI and ES:DI on to the next segment when needed
+;
+; Called before every RLE control byte and every LZSS token group, neither of
+; which reads or writes more than a few KiB, so the offsets never wrap around.
+; An offset reaching STEP_LIMIT is lowered by STEP_SIZE and its segment raised to
+; match, this keeps DI above the LZSS window for match sources (DI - offset).
+; Clobbers AX.
+;------------------------------------------------------------------------------
+step_segments:
+    test si, si             ; Offsets below STEP_LIMIT (0x8000) have the top bit clear
+    jns step_destination
+    sub si, STEP_SIZE
+    mov ax, ds
+    add ax, STEP_SIZE >> 4
+    mov ds, ax
+
+step_destination:
+    test di, di
+    jns stepped
+    sub di, STEP_SIZE
+    mov ax, es
+    add ax, STEP_SIZE >> 4
+    mov es, ax
+
+stepped:
+    ret
+
+;------------------------------------------------------------------------------
+; Unpack block - Decompresses and decrypts one block of the application data
 ; 
-; This function performs RLE (Run-Length Encoding) decompression with XOR 
-; decryption to restore the application to its original form before execution.
-; The packed and encrypted data is loaded into memory at LOAD_ADDR by the 
-; bootloader and is unpacked to DECODE_ADDR, ready for execution.
+; This function performs escape-coded RLE (Run-Length Encoding) decompression with
+; XOR decryption to restore the application to its original form before execution.
+; Every block starts with the byte of its codec, chosen by the packer block by block,
+; and blocks packed with LZSS are handed over to 'unpack_lz' instead.
+;
+; Each block starts with a control byte:
+;   - 0x01-0x7f: Run, the next byte is repeated this many times
+;   - 0x81-0xff: Literal block, the low 7 bits give the number of bytes that follow
+;   - 0x00:      End of data
+;
+; Every byte written is added into a pair of checksums (Fletcher-16, modulo 256):
+; BL sums the bytes and BH sums BL after every byte. The packer seeds them in the
+; header so that both end at zero for the intact application, which costs two
+; additions per byte instead of a second pass over the output.
 ;
 ; Registers used:
-;   - SI: Source pointer, initially set to LOAD_ADDR (compressed and encrypted data)
-;   - DI: Destination pointer, initially set to DECODE_ADDR (decompressed data)
-;   - BL: XOR key used for decryption (constant value XOR_KEY)
-;   - CL: Counter for RLE decompression (number of bytes to write)
+;   - DS:SI: Source pointer (compressed and encrypted data), left after the end marker
+;   - ES:DI: Destination pointer (decompressed data), left after the decoded block
+;   - CX: Counter for RLE decompression (number of bytes to write, CH stays zero)
+;   - BL, BH: Checksums of the output so far
+;   - DX: Run length and byte of a run (second stage only)
 ;
 ; Process:
-;   1. Read the repetition count and byte to repeat from the compressed data
-;   2. Apply XOR decryption to the byte
-;   3. Write the decrypted byte to the destination address DI
-;   4. Repeat until all bytes are written, or a zero repetition count signals the end
+;   1. Read the control byte from the compressed data ('lodsb')
+;   2. For a run, read and decrypt the byte to repeat and write it CX times to DI
+;   3. For a literal block, decrypt and write each of the CX bytes that follow to DI
+;   4. Add every byte written to the checksums
+;   5. Repeat until a zero control byte signals the end
 ;------------------------------------------------------------------------------
-unpack:
-    mov si, LOAD_ADDR       ; Set source pointer to compressed data start
-    mov di, DECODE_ADDR     ; Set destination pointer to decompressed data start
-    mov bl, XOR_KEY         ; Load the XOR decryption key into BL
+unpack_block:
+    lodsb                   ; Load the codec of the block
+%if FORMAT_CODEC < 0
+    cmp al, CODEC_LZ
+    je unpack_lz            ; Use the LZSS decoder if the block was packed with it
+%endif
+%if FORMAT_CODEC != CODEC_LZ
+    xor cx, cx              ; Counts fit in CL, and every loop below leaves CX zero
 
 next:
-    mov al, [si]            ; Load the repetition count into AL
-    inc si                  ; Move to the byte to repeat
-    cmp al, 0x00            ; Check for end of data
-    je  done                ; If zero, end unpacking
-
-    mov cl, al              ; Store repetition count in CL
-    mov al, [si]            ; Load the byte to repeat
-    inc si                  ; Move to the next RLE entry
-    xor al, bl              ; Decrypt the byte using XOR
-
-repeat:
-    mov [es:di], al         ; Write the decrypted byte to memory at ES:DI
-    inc di                  ; Increment destination pointer
-    dec cl                  ; Decrement repetition counter
-    jnz repeat              ; Repeat until count reaches zero
+    call step_segments      ; Keep SI and DI from wrapping around
+    lodsb                   ; Load the control byte into AL
+    test al, al             ; Check for end of data
+    jz done                 ; If zero, end unpacking
+
+    mov cl, al              ; Store the count in CL
+%if FORMAT_RUNS && FORMAT_LITERALS
+    js literal              ; Top bit set (from 'test'), a literal block
+%endif
+
+%if FORMAT_RUNS
+    lodsb                   ; Load the byte to repeat
+    xor al, XOR_KEY         ; Decrypt the byte using XOR
+
+run:
+%ifdef STAGE2
+    STORE_RUN               ; Write the whole run at once
+%else
+    stosb                   ; Write the byte to memory at ES:DI
+    add bl, al              ; Add it to the checksums
+    add bh, bl
+    loop run                ; Repeat until count reaches zero
+%endif
+
+    jmp next                ; Move to the next block of RLE data
+%endif
+
+%if FORMAT_LITERALS
+literal:
+    and cl, 0x7f            ; Number of literal bytes that follow
+
+copy:
+    lodsb                   ; Load the next literal byte
+    xor al, XOR_KEY         ; Decrypt the byte using XOR
+    stosb                   ; Write the decrypted byte to memory at ES:DI
+    add bl, al              ; Add it to the checksums
+    add bh, bl
+    loop copy               ; Copy until count reaches zero
 
     jmp next                ; Move to the next block of RLE data
+%endif
+
+done:
+    ret                     ; Return to caller (block complete)
+%endif
 
+;------------------------------------------------------------------------------
+; Unpack LZ - Decompresses and decrypts LZSS packed application data
+;
+; Entered from 'unpack_block' with SI past the codec byte and DI set up. Every
+; group of eight tokens starts with a flag byte, one bit per token (least
+; significant bit first):
+;   - 1: Literal, the next byte is decrypted and written
+;   - 0: Match, a word with the offset back into the output (low 12 bits) and
+;        the length minus LZ_MIN_MATCH (high 4 bits). A length field of 15 is
+;        followed by a byte that adds to the length. A zero offset ends the data
+;
+; Registers used:
+;   - DS:SI: Source pointer (compressed and encrypted data)
+;   - ES:DI: Destination pointer (decompressed data)
+;   - DX: Flag bits of the current group, above a marker bit (bit 8 of the flag byte)
+;   - CX: Length of the current match
+;   - BL, BH: Checksums of the output so far (see 'unpack_block')
+;------------------------------------------------------------------------------
+%if FORMAT_CODEC != CODEC_RLE
+unpack_lz:
+    call step_segments      ; Keep SI and DI from wrapping around
+    lodsb                   ; Load the flag byte of the next group
+    mov ah, 1               ; Above a marker bit that ends the group
+    xchg ax, dx
+
+lz_token:
+    shr dx, 1               ; Move the flag of the next token into CF
+    jz unpack_lz            ; Only the marker bit left, move to the next group
+%if FORMAT_LITERALS
+    jnc lz_match            ; If zero, the token is a match
+
+    lodsb                   ; Load the literal byte
+    xor al, XOR_KEY         ; Decrypt the byte using XOR
+    stosb                   ; Write the decrypted byte to memory at ES:DI
+    add bl, al              ; Add it to the checksums
+    add bh, bl
+    jmp lz_token
+%endif
+
+lz_match:
+    lodsw                   ; Load the match word
+    mov cx, ax
+    and ax, 0x0fff          ; Offset back into the output
+    jz done                 ; If zero, end unpacking
+    shr cx, 12              ; Length minus LZ_MIN_MATCH
+%if FORMAT_LONG_MATCHES
+    cmp cl, 15              ; Check for an extra length byte
+    jne lz_copy
+    add cl, [si]            ; Add the extra length byte
+    adc ch, ch              ; (CH is zero)
+    inc si
+%endif
+
+lz_copy:
+    add cx, LZ_MIN_MATCH
+    push ds
+    push si
+    push es                 ; The match is copied within the decompressed data
+    pop ds
+    mov si, di
+    sub si, ax              ; Source of the match in the decompressed data
+
+lz_byte:
+    lodsb                   ; Copy the match byte by byte, so overlapping copies repeat
+    stosb
+    add bl, al              ; Add it to the checksums
+    add bh, bl
+    loop lz_byte
+    pop si
+    pop ds
+    jmp lz_token
+
+%if FORMAT_CODEC == CODEC_LZ
 done:
-    ret                     ; Return to caller (unpacking complete)
+    ret                     ; Return to caller (block complete)
+%endif
+%endif
+%endif
 
+; Variables with initial values, in the boot sector as the BIOS loads nothing past it
+; (or in the second stage, which the first stage loads whole)
+%ifdef PMODE
+gdt:                        ; Global descriptor table for 'unpack_protected'
+    dq 0                    ; Null descriptor
+    dq 0x00cf9a000000ffff   ; CODE32_SEL: base 0, limit 4 GiB, 32-bit code
+    dq 0x00cf92000000ffff   ; DATA32_SEL: base 0, limit 4 GiB, 32-bit data
+    dq 0x00009a000000ffff   ; CODE16_SEL: base 0, limit 64 KiB, 16-bit code
+    dq 0x000092000000ffff   ; DATA16_SEL: base 0, limit 64 KiB, 16-bit data
+gdt_descriptor:
+    dw gdt_descriptor - gdt - 1 ; Size of the GDT minus one
+    dd gdt                  ; Linear address of the GDT
+%else
+unpack_dst dd DECODE_ADDR   ; Decoder state: destination pointer (0x0000:DECODE_ADDR),
+unpack_index dw header + HEADER_SIZE ; next block index entry (in 'header')
+%endif
+
+dap:                        ; Disk address packet for extended reads (AH=42h)
+    db 0x10                 ; Size of the packet
+    db 0                    ; Reserved
+dap_count dw 0              ; Number of sectors to read
+    dw SECTOR_SIZE          ; Destination offset, reads go to ES:0200 (see 'load')
+dap_segment dw 0            ; Destination segment
+dap_lba dd 0, 0             ; LBA of the next read (64 bit), taken from the directory
+
+read_retries db READ_RETRIES ; Single sector read retries left
+
+%ifdef STAGE2
+; Second stage padding to whole sectors, the first stage reads no more
+    times (SECTOR_SIZE - ($ - $$) % SECTOR_SIZE) % SECTOR_SIZE db 0
+    times -(($ - $$) > STAGE2_MAX_SECTORS * SECTOR_SIZE) db 0 ; Fails with more sectors
+%else
 ; Boot sector padding and signature
     times 510-($-$$) db 0   ; Pad the boot sector to 510 bytes
     dw 0xaa55               ; Boot sector signature (0xaa55), required for a bootable sector
+%endif
 
-section .data               ; Data section
+section .bss                ; Uninitialized data section, boot.bin ends with the boot sector
+                            ; (or the second stage, which has to end below DECODE_ADDR with it)
 
-    boot_drive db 0         ; Variable to store boot drive number
\ No newline at end of file
+    unpack_src resd 1       ; Decoder state between calls to 'unpack_ready': source pointer
+    header resb SECTOR_SIZE ; First payload sector: the payload header and the block index
+%ifdef STAGE2
+    times -(($ - $$) > STAGE2_VARS) resb 1 ; Fails with more than STAGE2_VARS
+%endif
\ No newline at end of file
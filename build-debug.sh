@@ -8,51 +8,95 @@
 #
 # Usage:
 #   ./build.sh
+#   STAGES=2 ./build.sh       (two-stage loader: stage1.asm, and boot.asm as the second stage)
+#   PMODE=1 ./build.sh        (two-stage loader whose second stage decodes in 32-bit protected mode)
+#   GENERIC=1 ./build.sh      (bootloader for every payload format, not just this application's)
+#   SERIAL=1 ./build.sh       (debug characters and output on COM1, which QEMU shows on stdio)
 #
 # Note: Make sure the script is executable before running it:
 #   chmod +x makefloppy.sh
 #
 # Requirements:
-#   Ensure that NASM, QEMU, and (if using packing) the packer and makefloppy scripts are available.
+#   Ensure that NASM, QEMU, and (if using packing) the packer are available.
 #
 # Steps:
 #   1. Removes any old build files
-#   2. Assembles the bootloader and application with NASM
-#   3. Optionally packs the application binary (currently commented out)
-#   4. Creates a floppy image and adds the bootloader and application
-#   5. Runs the floppy disk image in QEMU for testing
+#   2. Assembles the application with NASM
+#   3. Packs the application binary (or reuses the payload of an earlier build of the same
+#      application from .pack-cache) and verifies that it decodes back to the application
+#   4. Assembles the bootloader with the payload format the packer wrote, so it decodes
+#      only what the packed application holds
+#   5. Creates a floppy image and adds the bootloader and application
+#   6. Runs the floppy disk image in QEMU for testing
 
 # File paths
 BOOTLOADER="boot.bin"
+STAGE2="stage2.bin"                       # Second stage of the two-stage loader (STAGES=2)
 APPLICATION="application.bin"
 PACKED_APPLICATION="application-packed.bin"
+PAYLOAD_FORMAT="application-format.inc"   # Payload format for the bootloader, from the packer
+PACK_CACHE=".pack-cache"                   # Payloads of earlier builds, by input and options
 FLOPPY_IMAGE="floppy.img"
 
+# Debug flags for the bootloader and application
+DEBUG_FLAGS="-DDEBUG"
+if [ -n "$SERIAL" ]; then
+    DEBUG_FLAGS="$DEBUG_FLAGS -DSERIAL"
+fi
+
 # Clean up previous builds
 echo "Removing old build files..."
-rm -f "$FLOPPY_IMAGE" "$BOOTLOADER" "$APPLICATION" "$PACKED_APPLICATION"
+rm -f "$FLOPPY_IMAGE" "$BOOTLOADER" "$STAGE2" "$APPLICATION" "$PACKED_APPLICATION" "$PAYLOAD_FORMAT"
 
-# Compile the packer
-echo "Compiling the packer..."
-gcc packer.c -o packer
+# Compile the packer, unless it is already built from this very source
+if [ -x packer ] && sha256sum --status -c packer.sha256 2> /dev/null; then
+    echo "Packer is up to date."
+else
+    echo "Compiling the packer..."
+    SOURCE_HASH=$(sha256sum packer.c | cut -d ' ' -f 1)   # Keys the packing cache, see packer.c
+    gcc -O2 -pthread -DPACKER_SOURCE="\"$SOURCE_HASH\"" packer.c -o packer || { echo "Packer compilation failed"; exit 1; }
+    sha256sum packer.c > packer.sha256
+fi
 
-# Assemble bootloader and application
-echo "Assembling bootloader and application..."
-nasm -f bin -DDEBUG boot.asm -o "$BOOTLOADER" || { echo "Bootloader assembly failed"; exit 1; }
-nasm -f bin -DDEBUG application.asm -o "$APPLICATION" || { echo "Application assembly failed"; exit 1; }
+# Assemble the application
+echo "Assembling application..."
+nasm -f bin $DEBUG_FLAGS application.asm -o "$APPLICATION" || { echo "Application assembly failed"; exit 1; }
 
 echo "Packing application..."
-./packer "$APPLICATION" "$PACKED_APPLICATION" || { echo "Packer failed"; exit 1; }
+./packer --cache "$PACK_CACHE" --codec auto --threads 0 --format "$PAYLOAD_FORMAT" "$APPLICATION" "$PACKED_APPLICATION" || { echo "Packer failed"; exit 1; }
 FINAL_APP="$PACKED_APPLICATION"
 
-# Create floppy image and write bootloader and application
+# Decode the payload the way the bootloader does, it has to give back the application
+echo "Verifying packed application..."
+./packer --verify "$APPLICATION" "$PACKED_APPLICATION" || { echo "Verification failed"; exit 1; }
+
+# Assemble the bootloader for the payload format, or for every format with GENERIC=1
+echo "Assembling bootloader..."
+FORMAT_FLAGS="-p $PAYLOAD_FORMAT"
+if [ -n "$GENERIC" ]; then
+    FORMAT_FLAGS=""
+fi
+STAGE2_OPTION=""
+if [ -n "$PMODE" ]; then
+    STAGES=2                              # The 32-bit decoder only fits the second stage
+    FORMAT_FLAGS="$FORMAT_FLAGS -DPMODE"
+fi
+if [ "$STAGES" = "2" ]; then
+    nasm -f bin $DEBUG_FLAGS stage1.asm -o "$BOOTLOADER" || { echo "Bootloader assembly failed"; exit 1; }
+    nasm -f bin $DEBUG_FLAGS $FORMAT_FLAGS -DSTAGE2 boot.asm -o "$STAGE2" || { echo "Second stage assembly failed"; exit 1; }
+    STAGE2_OPTION="--stage2 $STAGE2"
+else
+    nasm -f bin $DEBUG_FLAGS $FORMAT_FLAGS boot.asm -o "$BOOTLOADER" || { echo "Bootloader assembly failed"; exit 1; }
+fi
+
+# Create the floppy image with the bootloader and application, in one pass (checks the boot sector too)
 echo "Creating floppy disk image with bootloader and application..."
-./makefloppy.sh "$BOOTLOADER" "$FINAL_APP" "$FLOPPY_IMAGE" || { echo "Error creating floppy image"; exit 1; }
+./packer --image $STAGE2_OPTION "$BOOTLOADER" "$FINAL_APP" "$FLOPPY_IMAGE" || { echo "Error creating floppy image"; exit 1; }
 
 # Clean up temporary build files
 echo "Cleaning up temporary files..."
-rm -f "$APPLICATION" "$PACKED_APPLICATION" application-padded.bin "$BOOTLOADER"
+rm -f "$APPLICATION" "$PACKED_APPLICATION" application-padded.bin "$BOOTLOADER" "$STAGE2" "$PAYLOAD_FORMAT"
 
 # Run the floppy disk image in QEMU
 echo "Running the floppy image in QEMU..."
-qemu-system-x86_64 -drive file="$FLOPPY_IMAGE",format=raw,if=floppy,index=0 -boot a
\ No newline at end of file
+qemu-system-x86_64 -drive file="$FLOPPY_IMAGE",format=raw,if=floppy,index=0 -boot a -serial stdio
\ No newline at end of file
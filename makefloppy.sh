@@ -1,43 +1,51 @@
 #!/bin/bash
 
 # makefloppy.sh
-# 
-# This script creates a 1.44 MB floppy disk image by combining a bootloader and a packed application.
-# 
+#
+# This script creates a 1.44 MB floppy disk image by combining a bootloader and one or more packed
+# applications. With '--hdd' it creates a hard disk image instead, for USB and hard disk emulation,
+# where the bootloader reads by LBA (pack with '--geometry 63,16', the first payload sector is still read by CHS).
+#
 # Usage:
-#   ./makefloppy.sh <bootloader> <packed application> <output image>
+#   ./makefloppy.sh [--hdd] [--select <entry>] [--stage2 <second stage>] <bootloader> <packed application>... <output image>
 #
 # Example:
 #   ./makefloppy.sh boot.bin application-packed.bin floppy.img
+#   ./makefloppy.sh --hdd boot.bin application-packed.bin disk.img
+#   ./makefloppy.sh --select 1 boot.bin variant-a-packed.bin variant-b-packed.bin floppy.img
+#   ./makefloppy.sh --stage2 stage2.bin stage1.bin application-packed.bin floppy.img
 #
 # Note: Make sure the script is executable before running it:
 #   chmod +x makefloppy.sh
 #
-# The script performs the following steps:
-#   1. Creates a blank 1.44 MB floppy disk image (2880 sectors)
+# Requirements:
+#   The packer, built next to this script (see packer.c), which writes the image with '--image'.
+#
+# The packer performs the following steps, writing the image front to back in a single pass:
+#   1. Checks that the bootloader is exactly one sector and ends with the 0xaa55 signature
 #   2. Writes the bootloader to the first sector (sector 0) of the disk image
-#   3. Writes the packed application to the second sector (sector 1) <-- IMPORTANT!
-#   4. Outputs a floppy disk image that can be used with QEMU or other emulators
+#   3. Writes the directory to the second sector (sector 1) <-- IMPORTANT!
+#   4. With '--stage2', writes the second stage of the two-stage loader (see stage1.asm) from
+#      the third sector (sector 2) on, and records its number of sectors in the directory
+#   5. Writes the packed applications one after another from the third sector (sector 2) on,
+#      or from the sector after the second stage
+#   6. Extends the image to a 1.44 MB floppy (2880 sectors), or with '--hdd' to whole cylinders
+#      (16 heads, 63 sectors per track), leaving the rest of the disk as a hole in a sparse file
+#
+# Directory:
+#   The bootloader reads the directory first and loads only the application it selects, entry 0
+#   unless '--select' gives another (counted from 0). The directory starts with the LBA, the CHS
+#   position (CX, then the head) of the selected application, followed by the number of entries
+#   and the selected entry, and from offset 8 on an entry of 8 bytes per application: the LBA
+#   (word), the cylinder and sector as CX for a CHS read (word), the head (byte), the codec (byte)
+#   and the number of sectors (word); byte 7 holds the number of second stage sectors. The CHS
+#   positions use the geometry in the payload headers, which has to be the same for every
+#   application, and with '--hdd' the disk's own (63,16).
 
-# Check if we have the correct number of arguments
-if [ "$#" -ne 3 ]; then
-    echo "Usage: $0 <bootloader> <packed application> <output image>"
+PACKER="$(dirname "$0")/packer"
+if [ ! -x "$PACKER" ]; then
+    echo "Error: $PACKER not found, build it first (gcc -O2 -pthread -DPACKER_SOURCE=\"\\\"\$(sha256sum packer.c | cut -d ' ' -f 1)\\\"\" packer.c -o packer)"
     exit 1
 fi
 
-# Assign arguments to variables
-BOOTLOADER=$1
-APPLICATION=$2
-OUTPUT=$3
-
-# Create a blank 1.44 MB floppy disk image (2880 sectors)
-dd if=/dev/zero of="$OUTPUT" bs=512 count=2880
-
-# Write the bootloader to the first sector (sector 0) of the floppy image
-dd if="$BOOTLOADER" of="$OUTPUT" conv=notrunc
-
-# Write the packed application to the second sector (sector 1) of the floppy image
-dd if="$APPLICATION" of="$OUTPUT" bs=512 seek=1 conv=notrunc
-
-# Print a success message
-echo "Floppy disk image created: $OUTPUT"
\ No newline at end of file
+exec "$PACKER" --image "$@"
@@ -1,7 +1,7 @@
 /*
  * packer.c
  * 
- * This program performs RLE (Run-Length Encoding) compression with XOR encryption 
+ * This program performs RLE (Run-Length Encoding) or LZSS compression with XOR encryption 
  * to prepare an application binary file for use by a bootloader. The packed file 
  * contains compressed and encrypted data, making it ready for loading by the bootloader.
  * 
@@ -10,24 +10,50 @@
  * 
  * Building and running:
  * 
- * 1. Build the packer:
- *      gcc packer.c -o packer
+ * 1. Build the packer, with the hash of its source as the packing cache key (see PACKER_SOURCE):
+ *      gcc -O2 -pthread -DPACKER_SOURCE="\"$(sha256sum packer.c | cut -d ' ' -f 1)\"" packer.c -o packer
  * 
  * 2. Run the packer with the input and output files specified:
- *      ./packer <input file> <output file>
+ *      ./packer [--geometry <sectors per track>,<heads>] [--codec rle|lz|auto] [--stream | --optimal | --threads <count>]
+ *               [--cache <directory>] [--format <include file>] <input file> <output file>
  * 
  *    Example:
  *      ./packer application.bin application-packed.bin
+ *
+ * 3. Check that the payload decodes back to the input at boot (build-release.sh does), or
+ *    decode a payload:
+ *      ./packer --verify <input file> <packed file>
+ *      ./packer --unpack <packed file> <output file>
+ *
+ * 4. Write the bootable disk image from the bootloader and one or more packed files
+ *    (makefloppy.sh does):
+ *      ./packer --image [--hdd] [--select <entry>] [--stage2 <second stage>] <bootloader> <packed file>...
+ *               <output image>
+ *
+ * 5. Or benchmark every codec and mode on a set of inputs (see bench.sh):
+ *      ./packer --benchmark <input file>...
+ *
+ * 6. Or pack many inputs in one run, one '[options] <input file> <output file>' per line of
+ *    a manifest:
+ *      ./packer [options] --batch [--threads <count>] <manifest>
  * 
  * This will produce the following output:
  * 
  * - Original size of the input file
- * - Compressed size after RLE compression
+ * - Compressed size after compression (including the payload header)
  * - Compression ratio as a percentage
  * - Total sectors (512 bytes each) required after padding
  * 
- * Output file ('application-packed.bin' in this example) is created with RLE-compressed 
- * and XOR-encrypted data, padded to the nearest 512-byte sector boundary.
+ * Output file ('application-packed.bin' in this example) is created with a payload header
+ * followed by compressed (escape-coded RLE or LZSS) and XOR-encrypted data, padded to the
+ * nearest 512-byte sector boundary. The header holds the codec, the sector count and the
+ * disk geometry (a 1.44 MB floppy unless '--geometry' is given) the bootloader needs to
+ * read the payload a whole track at a time, and a checksum the bootloader checks the
+ * unpacked application against. '--threads' packs independent blocks in
+ * parallel. '--optimal' trades packing time for the smallest
+ * output, which is what release images want, and '--cache' makes repeating it for an
+ * unchanged input free. '--format' describes the payload in a NASM include, from which
+ * the bootloader assembles a decoder for just that payload.
  * 
  * MIT License
  * 
@@ -52,8 +78,23 @@
  * SOFTWARE.
  */
 
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 // XOR encryption key
 #define XOR_KEY 0x69
@@ -61,140 +102,3858 @@
 // Sector size
 #define SECTOR_SIZE 512
 
+// Memory layout of the bootloader: the application is unpacked in place to DECODE_ADDR,
+// from a payload loaded at the tail of the same region, which must end below LOAD_LIMIT
+// (the top of conventional memory, below the EBDA on common BIOSes)
+#define DECODE_ADDR 0xa000
+#define LOAD_LIMIT  0x9f000
+
+// Payload header, read by the bootloader from the first payload sector with the block
+// index that follows it (see pack_blocks())
+#define HEADER_VERSION 8
+#define HEADER_SIZE    14
+#define INDEX_END      0xffff                // Ends the block index, never ready at boot
+
+// Compression backends. Every packed stream (block) starts with the byte of its codec, so
+// the bootloader picks the matching decoder block by block; a stored block is written as
+// RLE literal blocks only, which the RLE decoder handles. The header holds the codec of
+// every block, or CODEC_MIXED when they differ
+#define CODEC_RLE    0
+#define CODEC_LZ     1
+#define CODEC_STORED 2
+#define CODECS       3
+#define CODEC_MIXED  0xff
+#define CODEC_AUTO   -1                      // '--codec auto', chosen per block (see choose_codec())
+
+// Size of the table of earlier positions analyze_block() probes for LZSS matches, one
+// candidate per hash (16 KiB, it stays in the L1 cache)
+#define PROBE_HASH_BITS 12
+
+// Escape-coded RLE: a control byte of 1-127 is a run of that many copies of the next byte,
+// 0x80 | n is n (1-127) literal bytes that follow, and 0 ends the data
+#define MAX_RUN      127
+#define MAX_LITERALS 127
+#define LITERAL_FLAG 0x80
+
+// LZSS: a flag byte precedes every eight tokens, one bit per token (least significant bit
+// first), 1 for a literal byte and 0 for a match. A match is a little-endian word with the
+// offset back into the output (1-4095) in the low 12 bits and the length minus LZ_MIN_MATCH
+// in the high 4 bits; a length field of 15 is followed by a byte adding to the length.
+// A match word of zero ends the data.
+#define LZ_WINDOW       4095                 // Largest match offset
+#define LZ_MIN_MATCH    3
+#define LZ_LONG_MATCH   (LZ_MIN_MATCH + 15)  // Shortest match that needs the extra length byte
+#define LZ_MAX_MATCH    (LZ_LONG_MATCH + 255)
+#define LZ_HISTORY      4096                 // Size of the hash chain ring (above LZ_WINDOW)
+#define LZ_HASH_BITS    15
+#define LZ_CHAIN_DEPTH  256                  // Candidates tried per position (greedy parse)
+#define LZ_BUFFER_SIZE  (STREAM_CHUNK_SIZE + LZ_WINDOW + LZ_MAX_MATCH + 1)
+
+// Input bytes per independently packed block ('--threads'). A packed block is about a
+// floppy track, so the bootloader can decode one block after every track it reads, and
+// it always fits the 16-bit sizes of the block index
+#define BLOCK_SIZE 8192
+
+// Default disk geometry (1.44 MB floppy)
+#define DEFAULT_SECTORS_PER_TRACK 18
+#define DEFAULT_HEADS             2
+
+// Disk images ('--image'): the boot sector, the directory sector the bootloader reads next,
+// and the packed applications from FIRST_PAYLOAD_LBA on. A floppy image is a 1.44 MB floppy,
+// a hard disk image ('--hdd') whole cylinders of HDD_HEADS heads of HDD_SECTORS_PER_TRACK
+#define BOOT_SIGNATURE        0xaa55         // Last word of the boot sector
+#define FIRST_PAYLOAD_LBA     2
+#define DIRECTORY_ENTRIES     8              // Offset of the first directory entry
+#define DIRECTORY_ENTRY_SIZE  8
+#define DIRECTORY_MAX_ENTRIES ((SECTOR_SIZE - DIRECTORY_ENTRIES) / DIRECTORY_ENTRY_SIZE)
+#define FLOPPY_SECTORS        2880
+#define HDD_SECTORS_PER_TRACK 63
+#define HDD_HEADS             16
+#define MAX_PAYLOAD_LBA       0x10000        // Directory LBAs are words
+#define MAX_CHS_CYLINDER      255            // CHS reads step CH only, bits 8-9 in CL stay clear
+
+// Two-stage images ('--stage2'): the second stage follows the directory, and the first stage
+// (stage1.asm) reads both from the first track, the directory byte DIRECTORY_STAGE2 gives the
+// number of second stage sectors. Loaded at STAGE2_ADDR, the second stage and its variables
+// (STAGE2_VARS: a sector and a far pointer) have to end below DECODE_ADDR, which leaves 14
+// sectors. Derived as in boot.asm, which fails to assemble a larger second stage
+#define DIRECTORY_STAGE2      7
+#define STAGE2_ADDR           0x8000
+#define STAGE2_VARS           (4 + SECTOR_SIZE)
+#define STAGE2_MAX_SECTORS    ((DECODE_ADDR - STAGE2_ADDR - STAGE2_VARS) / SECTOR_SIZE)
+
+// Size of the input buffer used in streaming mode
+#define STREAM_CHUNK_SIZE 65536
+
+// Initial size of the output buffer, and its fixed size in streaming mode
+#define EMIT_BUFFER_SIZE 65536
+
+// Shortest time a benchmark ('--benchmark') repeats each measurement for, in seconds
+#define BENCH_MIN_SECONDS 0.25
+
+// Packing cache ('--cache'): payloads are stored under a 64-bit FNV-1a hash of the input
+// bytes, the options and the packer source, so a changed packer never reuses old payloads.
+// The build scripts pass the SHA-256 of packer.c (the one they record in packer.sha256) as
+// PACKER_SOURCE, which keys the same source the same way on every build; a packer compiled
+// without it falls back to its build time, which only reuses payloads of the same binary
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME        0x100000001b3ULL
+#ifndef PACKER_SOURCE
+#define PACKER_SOURCE    __DATE__ " " __TIME__
+#endif
+
+/**
+ * Output buffer the encoder writes into instead of calling stdio per byte.
+ *
+ * Without a file to flush to, the buffer grows (doubling) to hold the whole packed
+ * output, which is then written with a single fwrite(). With a file (streaming mode),
+ * the buffer keeps its size and is written out whenever it fills up. A mapped buffer
+ * (see emit_init_mapped()) is the output file itself, grown with the file, so the output
+ * is written straight into the page cache and never copied.
+ */
+struct emitter {
+    unsigned char *data;                     // Buffered output
+    size_t length;                           // Number of bytes in the buffer
+    size_t capacity;                         // Size of the buffer
+    size_t total;                            // Number of bytes emitted, flushed ones included
+    FILE *flush;                             // File to flush to when full (NULL to grow instead)
+    int fd;                                  // Output file the buffer maps, -1 for a buffer in memory
+    int failed;                              // Set when growing or flushing the buffer failed
+};
+
+/**
+ * RLE encoder state, carried between calls to compress() so that a run crossing
+ * the end of one chunk of input merges with its continuation in the next chunk.
+ * Bytes that do not repeat are collected until a literal block can be written.
+ */
+struct rle_state {
+    unsigned char byte;                      // Byte value of the pending run
+    unsigned int repeats;                    // Length of the pending run (0 if none)
+    unsigned char literal[MAX_LITERALS];     // Pending literal bytes (not encrypted)
+    unsigned int literals;                   // Number of pending literal bytes
+};
+
+/**
+ * LZ encoder state. The input is copied into a sliding buffer that keeps the last
+ * LZ_WINDOW bytes as history for matches, so it can be fed in chunks like the RLE
+ * encoder. Positions are absolute offsets into the whole input.
+ */
+struct lz_state {
+    unsigned char buffer[LZ_BUFFER_SIZE];    // History and lookahead
+    size_t base;                             // Absolute position of buffer[0]
+    size_t end;                              // Absolute position after the last buffered byte
+    size_t pos;                              // Absolute position of the next byte to encode
+    size_t head[1 << LZ_HASH_BITS];          // Most recent position + 1 for each hash (0 if none)
+    size_t prev[LZ_HISTORY];                 // Previous position + 1 with the same hash
+    size_t hashed;                           // Positions below this are in the hash chains
+    unsigned int depth;                      // Candidates tried per position
+    unsigned char group[1 + 8 * 3];          // Flag byte and up to eight pending tokens
+    size_t group_length;                     // Bytes in 'group' (flag byte included)
+    unsigned int tokens;                     // Tokens in 'group'
+};
+
+/**
+ * Encoder for the selected compression backend.
+ */
+struct encoder {
+    int codec;                               // CODEC_RLE, CODEC_LZ or CODEC_STORED
+    struct rle_state rle;                    // Also collects the literal blocks of CODEC_STORED
+    struct lz_state *lz;                     // Allocated for CODEC_LZ only
+    int keep;                                // Keep 'lz' for the next input (see encoder_select())
+};
+
+/**
+ * Checksums of the unpacked application (Fletcher-16, modulo 256), which the bootloader
+ * adds every byte it writes to: 'a' sums the bytes and 'b' sums 'a' after every byte.
+ */
+struct checksum {
+    unsigned char a;
+    unsigned char b;
+    size_t length;                           // Number of bytes summed
+};
+
+/**
+ * Format of a packed payload: the parameters a bootloader specialized to it needs, and
+ * which of the tokens the decoders handle occur in it at all ('--format').
+ */
+struct payload_format {
+    int codec;
+    unsigned int sectors;                    // Payload sectors, the header sector included
+    unsigned int sectors_per_track;
+    unsigned int heads;
+    unsigned int blocks;
+    int runs;                                // RLE runs occur
+    int literals;                            // RLE literal blocks or LZSS literals occur
+    int long_matches;                        // LZSS matches with the extra length byte occur
+};
+
+/**
+ * Statistics of a block of input, gathered in a single sweep by analyze_block(), from which
+ * choose_codec() estimates what every codec would pack the block to.
+ */
+struct block_stats {
+    size_t runs;                             // RLE runs, one per MAX_RUN bytes of every run of three or more
+    size_t run_bytes;                        // Bytes in those runs
+    size_t literal_blocks;                   // RLE literal blocks between the runs
+    size_t lz_literals;                      // LZSS literals
+    size_t matches;                          // LZSS matches, those at offset 1 over runs included
+    size_t long_matches;                     // Matches that need the extra length byte
+};
+
+/**
+ * Options a payload is packed with, from the command line or an entry of a batch manifest.
+ */
+struct pack_options {
+    unsigned int sectors_per_track;
+    unsigned int heads;
+    int codec;                               // CODEC_RLE, CODEC_LZ or CODEC_AUTO
+    int stream;                              // Pack in fixed-size chunks ('--stream')
+    int optimal;                             // Search for the smallest encoding ('--optimal')
+    int threads;                             // Block-parallel mode on this many threads, -1 for a single stream
+};
+
+/**
+ * What packing a payload came to, for the summary.
+ */
+struct pack_result {
+    unsigned int original_size;
+    unsigned int compressed_size;            // Payload size before the sector padding
+    unsigned int sectors;
+    size_t margin;                           // In-place margin, see margin_update()
+    unsigned int blocks;                     // Number of blocks, 1 for a single stream
+    unsigned int used[CODECS];               // Blocks packed with each codec
+    unsigned int level, levels;              // Optimal parse level used and levels tried
+};
+
 /**
  * XOR encrypts the input data in place.
  *
+ * Works a 64-bit word at a time (which the compiler vectorizes further), with a byte
+ * loop for the tail. The RLE encoder uses it on the literal blocks it writes, and for
+ * runs encrypts only the byte value.
+ *
  * @param data   Pointer to the data buffer to encrypt.
  * @param length Length of the data in bytes.
  */
-void encrypt(unsigned char *data, unsigned int length) {
-    for (unsigned int i = 0; i < length; i++) {
+void encrypt(unsigned char *data, size_t length) {
+    const uint64_t key = 0x0101010101010101ULL * XOR_KEY;
+    size_t i = 0;
+
+    for (; i + sizeof(key) <= length; i += sizeof(key)) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        word ^= key;
+        memcpy(data + i, &word, sizeof(word));
+    }
+    for (; i < length; i++) {
         data[i] ^= XOR_KEY;
     }
 }
 
 /**
- * Compresses the input data using Run-Length Encoding (RLE).
+ * Adds data to the checksums.
+ *
+ * @param sum    Pointer to the checksums.
+ * @param data   Pointer to the data.
+ * @param length Length of the data in bytes.
+ */
+void checksum_update(struct checksum *sum, const unsigned char *data, size_t length) {
+    unsigned char a = sum->a, b = sum->b;
+
+    for (size_t i = 0; i < length; i++) {
+        a += data[i];
+        b += a;
+    }
+    sum->a = a;
+    sum->b = b;
+    sum->length += length;
+}
+
+/**
+ * Returns the checksum seed for the header, the starting sums that bring both checksums
+ * to zero at the end of the application.
  *
- * Each run of identical bytes is stored as a length byte followed by the byte value,
- * allowing repeated values to be compressed effectively.
+ * Starting from a0 and b0 instead of zero, n bytes end at a0 + a and b0 + n * a0 + b, so
+ * a0 is -a and b0 is -(n * a0 + b), modulo 256.
  *
- * @param data    Pointer to the data buffer to compress.
- * @param length  Length of the data in bytes.
- * @param output  Pointer to the output file where compressed data is written.
+ * @param sum  Pointer to the checksums of the whole application, started at zero.
+ * @return     The seed, a0 in the low byte and b0 in the high byte.
  */
-void compress(unsigned char *data, unsigned int length, FILE *output) {
-    for (unsigned int i = 0; i < length;) {
-        unsigned char byte = data[i];
-        unsigned char repeats = 1;
+unsigned int checksum_seed(const struct checksum *sum) {
+    unsigned char a0 = -sum->a;
+    unsigned char b0 = -(unsigned char)((sum->length & 0xff) * a0 + sum->b);
+    return a0 | b0 << 8;
+}
 
-        while ((i + repeats < length) && (data[i + repeats] == byte) && (repeats < 255)) {
-            repeats++;
-        }
+/**
+ * Initializes an output buffer.
+ *
+ * @param e         Pointer to the emitter.
+ * @param capacity  Initial size of the buffer in bytes.
+ * @param flush     File to flush to when the buffer is full, or NULL to grow the buffer.
+ * @return          0 on success, 1 on failure.
+ */
+int emit_init(struct emitter *e, size_t capacity, FILE *flush) {
+    e->data = malloc(capacity);
+    e->length = 0;
+    e->capacity = capacity;
+    e->total = 0;
+    e->flush = flush;
+    e->fd = -1;
+    e->failed = 0;
+    if (!e->data) {
+        perror("Memory allocation failed");
+        return 1;
+    }
+    return 0;
+}
 
-        fputc(repeats, output);              // Write repetition count
-        fputc(byte, output);                 // Write the byte value
-        i += repeats;
+/**
+ * Initializes an output buffer that maps the output file, which is extended to 'capacity'.
+ *
+ * The buffer grows like one in memory (see emit_reserve()), by extending the file and
+ * mapping it again, and emit_release() cuts the file to the bytes emitted. The file is
+ * extended with posix_fallocate() rather than ftruncate(), so its blocks exist before they
+ * are mapped: a full disk then fails here instead of raising SIGBUS on a store into a hole.
+ * Nothing is reported if the file cannot be mapped, the caller falls back to emit_init() (that
+ * is no error).
+ *
+ * @param e         Pointer to the emitter.
+ * @param capacity  Initial size of the buffer in bytes.
+ * @param fd        Output file, opened for reading and writing and empty.
+ * @return          0 on success, 1 if the file cannot be mapped.
+ */
+int emit_init_mapped(struct emitter *e, size_t capacity, int fd) {
+    void *data = posix_fallocate(fd, 0, capacity) == 0
+                     ? mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (data == MAP_FAILED) {
+        if (ftruncate(fd, 0) != 0) {         // Empty again for the buffered writer
+            perror("Error emptying the output file");
+        }
+        return 1;
     }
+    e->data = data;
+    e->length = 0;
+    e->capacity = capacity;
+    e->total = 0;
+    e->flush = NULL;
+    e->fd = fd;
+    e->failed = 0;
+    return 0;
 }
 
 /**
- * Pads the output file to ensure its size is a multiple of 512 bytes (SECTOR_SIZE).
+ * Frees the buffer, or for a mapped buffer unmaps it and cuts the output file to the bytes
+ * emitted (a failure marks the emitter failed). Releasing it again does nothing.
  *
- * @param output    Pointer to the output file to pad.
- * @param file_size Current size of the file in bytes.
- * @return          The total size of the file in sectors after padding.
+ * @param e  Pointer to the emitter.
  */
-unsigned int pad_to_sector(FILE *output, unsigned int file_size) {
-    unsigned int padding_needed = SECTOR_SIZE - (file_size % SECTOR_SIZE);
-    if (padding_needed != SECTOR_SIZE) {
-        for (unsigned int i = 0; i < padding_needed; i++) {
-            fputc(0, output);               // Pad with zeros
+void emit_release(struct emitter *e) {
+    if (e->fd >= 0) {
+        if (munmap(e->data, e->capacity) != 0 || ftruncate(e->fd, e->total) != 0) {
+            e->failed = 1;
         }
-        file_size += padding_needed;
+        e->fd = -1;
+    } else {
+        free(e->data);
     }
-    return file_size / SECTOR_SIZE;
+    e->data = NULL;
 }
 
 /**
- * Main function that encrypts, compresses, and writes an input file to the output file.
+ * Empties an output buffer in memory for the next payload, keeping the buffer it has grown to.
  *
- * Usage:
- *   ./packer <input file> <output file>
- * 
- * Example:
- *   ./packer application.bin application-packed.bin
+ * @param e  Pointer to the emitter.
+ */
+void emit_reset(struct emitter *e) {
+    e->length = 0;
+    e->total = 0;
+    e->failed = 0;
+}
+
+/**
+ * Writes the buffered output to the flush file and empties the buffer.
  *
- * @param argc Argument count.
- * @param argv Argument vector.
- * @return     0 on success, 1 on failure.
+ * @param e  Pointer to the emitter.
  */
-int main(int argc, char *argv[]) {
-    if (argc != 3) {
-        fprintf(stderr, "Usage: %s <input file> <output file>\n", argv[0]);
-        return 1;
+void emit_flush(struct emitter *e) {
+    if (e->length > 0 && fwrite(e->data, 1, e->length, e->flush) != e->length) {
+        e->failed = 1;
     }
+    e->length = 0;
+}
 
-    // Open input and output files
-    FILE *input = fopen(argv[1], "rb");
-    FILE *output = fopen(argv[2], "wb");
-    if (!input) {
-        perror("Error opening input file");
-        return 1;
+/**
+ * Makes room for at least 'needed' more bytes in the buffer, flushing or growing it.
+ *
+ * @param e       Pointer to the emitter.
+ * @param needed  Number of bytes about to be emitted.
+ * @return        0 on success, 1 if there is no room (the emitter is marked failed).
+ */
+int emit_reserve(struct emitter *e, size_t needed) {
+    if (e->capacity - e->length >= needed) {
+        return 0;
     }
-    if (!output) {
-        perror("Error opening output file");
-        fclose(input);
+    if (e->flush) {
+        emit_flush(e);
+        if (e->capacity >= needed) {
+            return 0;
+        }
+    }
+
+    size_t capacity = e->capacity;
+    while (capacity - e->length < needed) {
+        capacity *= 2;
+    }
+    if (e->fd >= 0) {
+        // Allocate the blocks of the extended file and map it again, the bytes emitted so far
+        // stay in the file (see emit_init_mapped())
+        void *data = posix_fallocate(e->fd, e->capacity, capacity - e->capacity) == 0
+                         ? mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, e->fd, 0) : MAP_FAILED;
+        if (data == MAP_FAILED) {
+            e->failed = 1;                   // The old mapping stays valid
+            return 1;
+        }
+        munmap(e->data, e->capacity);
+        e->data = data;
+        e->capacity = capacity;
+        return 0;
+    }
+    unsigned char *data = realloc(e->data, capacity);
+    if (!data) {
+        e->failed = 1;
         return 1;
     }
+    e->data = data;
+    e->capacity = capacity;
+    return 0;
+}
 
-    // Read input file into memory
-    fseek(input, 0, SEEK_END);
-    unsigned int original_size = ftell(input); // Store the original file size
-    fseek(input, 0, SEEK_SET);
+/**
+ * Appends one byte to the output buffer.
+ *
+ * @param e     Pointer to the emitter.
+ * @param byte  Byte to append.
+ */
+static inline void emit_byte(struct emitter *e, unsigned char byte) {
+    if (e->length == e->capacity && emit_reserve(e, 1)) {
+        return;
+    }
+    e->data[e->length++] = byte;
+    e->total++;
+}
 
-    if (original_size == 0) {
-        fprintf(stderr, "Error: Input file is empty.\n");
-        fclose(input);
-        fclose(output);
-        return 1;
+/**
+ * Appends a run (repetition count followed by the byte value) to the output buffer.
+ *
+ * @param e        Pointer to the emitter.
+ * @param repeats  Repetition count.
+ * @param byte     Byte value.
+ */
+static inline void emit_run(struct emitter *e, unsigned char repeats, unsigned char byte) {
+    if (e->capacity - e->length < 2 && emit_reserve(e, 2)) {
+        return;
     }
+    e->data[e->length++] = repeats;
+    e->data[e->length++] = byte;
+    e->total += 2;
+}
 
-    unsigned char *data = malloc(original_size);
-    if (!data) {
-        perror("Memory allocation failed");
-        fclose(input);
-        fclose(output);
-        return 1;
+/**
+ * Appends a literal block (control byte followed by the encrypted bytes) to the output buffer.
+ *
+ * @param e       Pointer to the emitter.
+ * @param data    Pointer to the literal bytes (not encrypted).
+ * @param count   Number of literal bytes (1 to MAX_LITERALS).
+ */
+void emit_literals(struct emitter *e, const unsigned char *data, size_t count) {
+    if (emit_reserve(e, count + 1)) {
+        return;
     }
-    if (fread(data, 1, original_size, input) != original_size) {
-        perror("Error reading input file");
-        fclose(output);
-        free(data);
+    e->data[e->length] = LITERAL_FLAG | count;
+    memcpy(e->data + e->length + 1, data, count);
+    encrypt(e->data + e->length + 1, count);
+    e->length += count + 1;
+    e->total += count + 1;
+}
+
+/**
+ * Appends 'count' copies of a byte to the output buffer.
+ *
+ * @param e      Pointer to the emitter.
+ * @param byte   Byte value.
+ * @param count  Number of bytes to append.
+ */
+void emit_fill(struct emitter *e, unsigned char byte, size_t count) {
+    if (emit_reserve(e, count)) {
+        return;
+    }
+    memset(e->data + e->length, byte, count);
+    e->length += count;
+    e->total += count;
+}
+
+/**
+ * Counts how many bytes at the start of 'data' are equal to 'byte' (scalar version).
+ *
+ * @param data    Pointer to the data to scan.
+ * @param length  Maximum number of bytes to scan.
+ * @param byte    Byte value of the run.
+ * @return        Length of the run, at most 'length'.
+ */
+static size_t run_length_scalar(const unsigned char *data, size_t length, unsigned char byte) {
+    size_t i = 0;
+    while ((i < length) && (data[i] == byte)) {
+        i++;
+    }
+    return i;
+}
+
+#ifdef HAVE_X86_SIMD
+/**
+ * Counts how many bytes at the start of 'data' are equal to 'byte', 16 bytes per step (SSE2).
+ *
+ * Each step compares 16 bytes against the run byte; the first zero bit in the movemask
+ * of the comparison is where the run ends.
+ */
+__attribute__((target("sse2")))
+static size_t run_length_sse2(const unsigned char *data, size_t length, unsigned char byte) {
+    const __m128i pattern = _mm_set1_epi8((char)byte);
+    size_t i = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(data + i));
+        unsigned int mismatch = ~_mm_movemask_epi8(_mm_cmpeq_epi8(chunk, pattern)) & 0xffff;
+        if (mismatch) {
+            return i + __builtin_ctz(mismatch);
+        }
+    }
+    return i + run_length_scalar(data + i, length - i, byte);
+}
+
+/**
+ * Counts how many bytes at the start of 'data' are equal to 'byte', 32 bytes per step (AVX2).
+ */
+__attribute__((target("avx2")))
+static size_t run_length_avx2(const unsigned char *data, size_t length, unsigned char byte) {
+    const __m256i pattern = _mm256_set1_epi8((char)byte);
+    size_t i = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(data + i));
+        unsigned int mismatch = ~(unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, pattern));
+        if (mismatch) {
+            return i + __builtin_ctz(mismatch);
+        }
+    }
+    return i + run_length_sse2(data + i, length - i, byte);
+}
+#endif
+
+// Run scanner used by the encoder, set to the best version for this CPU by run_length_init()
+static size_t (*run_length)(const unsigned char *, size_t, unsigned char) = run_length_scalar;
+
+/**
+ * Picks the run scanner for this CPU (AVX2, SSE2 or scalar). main() calls it once before
+ * anything else, so no thread is running yet and the workers only ever read the pointer.
+ */
+void run_length_init(void) {
+#ifdef HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        run_length = run_length_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        run_length = run_length_sse2;
+    }
+#endif
+}
+
+/**
+ * Writes the pending literal bytes as one literal block.
+ *
+ * @param state   Pointer to the encoder state.
+ * @param output  Pointer to the output buffer where compressed data is written.
+ */
+static void flush_literals(struct rle_state *state, struct emitter *output) {
+    if (state->literals > 0) {
+        emit_literals(output, state->literal, state->literals);
+        state->literals = 0;
+    }
+}
+
+/**
+ * Writes a finished run, either as a run or by adding its bytes to the pending literals.
+ *
+ * Runs of three or more bytes are always written as runs. A run of two costs two bytes
+ * either way, so it only starts a run when no literal block is open; otherwise it is
+ * cheaper to extend the literal block than to end it and start another one later.
+ *
+ * @param state   Pointer to the encoder state.
+ * @param output  Pointer to the output buffer where compressed data is written.
+ */
+static void flush_run(struct rle_state *state, struct emitter *output) {
+    if (state->repeats >= 3 || (state->repeats == 2 && state->literals == 0)) {
+        flush_literals(state, output);
+        emit_run(output, state->repeats, state->byte ^ XOR_KEY);
+    } else {
+        for (unsigned int i = 0; i < state->repeats; i++) {
+            state->literal[state->literals++] = state->byte;
+            if (state->literals == MAX_LITERALS) {
+                flush_literals(state, output);
+            }
+        }
+    }
+    state->repeats = 0;
+}
+
+/**
+ * Compresses and encrypts the input data using escape-coded Run-Length Encoding (RLE) and XOR.
+ *
+ * Each run of identical bytes is stored as a length byte (1-127) followed by the byte value,
+ * allowing repeated values to be compressed effectively. Bytes that do not repeat are stored
+ * in literal blocks, a control byte with the high bit set (0x80 | count) followed by up to 127
+ * raw bytes, so code without repeats grows by less than 1% instead of doubling.
+ *
+ * XOR with a constant key does not change where runs start or end, so runs are found on the
+ * plain data and only the bytes actually written are encrypted. The input may be fed in
+ * several chunks; the run and literals still open at the end of a chunk are kept in 'state'
+ * and are only written once they end, either in a later chunk or in compress_finish().
+ *
+ * @param state   Pointer to the encoder state (zero-initialized before the first chunk).
+ * @param data    Pointer to the data buffer to compress.
+ * @param length  Length of the data in bytes.
+ * @param output  Pointer to the output buffer where compressed data is written.
+ */
+void compress(struct rle_state *state, const unsigned char *data, unsigned int length, struct emitter *output) {
+    for (unsigned int i = 0; i < length;) {
+        if (state->repeats == 0) {
+            state->byte = data[i++];         // Start a new run
+            state->repeats = 1;
+        }
+
+        // Extend the run, scanning with the vectorized run scanner once it repeats
+        if ((i < length) && (data[i] == state->byte) && (state->repeats < MAX_RUN)) {
+            size_t limit = MAX_RUN - state->repeats;
+            if (limit > length - i) {
+                limit = length - i;
+            }
+            size_t count = run_length(data + i, limit, state->byte);
+            state->repeats += count;
+            i += count;
+        }
+
+        if (i < length) {                    // The run ended within this chunk
+            flush_run(state, output);
+        }
+    }
+}
+
+/**
+ * Writes the pending run and literals and terminates the compressed data with a zero byte.
+ *
+ * @param state   Pointer to the encoder state.
+ * @param output  Pointer to the output buffer where compressed data is written.
+ */
+void compress_finish(struct rle_state *state, struct emitter *output) {
+    flush_run(state, output);
+    flush_literals(state, output);
+
+    emit_byte(output, 0);                    // Write end marker (zero control byte)
+}
+
+/**
+ * Sliding window minimum over the last MAX_LITERALS positions (a monotonic queue), used
+ * by the optimal RLE parse. Keys increase from 'head' to 'tail'.
+ */
+struct window_min {
+    size_t pos[MAX_LITERALS + 1];
+    int64_t key[MAX_LITERALS + 1];
+    unsigned int head;
+    unsigned int tail;
+};
+
+/**
+ * Drops the positions below 'oldest' and adds 'pos' with 'key' to the window.
+ */
+static void window_push(struct window_min *w, size_t oldest, size_t pos, int64_t key) {
+    while (w->head != w->tail && w->pos[w->head % (MAX_LITERALS + 1)] < oldest) {
+        w->head++;
+    }
+    while (w->head != w->tail && w->key[(w->tail - 1) % (MAX_LITERALS + 1)] >= key) {
+        w->tail--;
+    }
+    w->pos[w->tail % (MAX_LITERALS + 1)] = pos;
+    w->key[w->tail % (MAX_LITERALS + 1)] = key;
+    w->tail++;
+}
+
+/**
+ * Compresses and encrypts the whole input with the smallest possible escape-coded RLE output.
+ *
+ * Unlike compress(), which decides run by run, this finds the cheapest split of the input
+ * into runs and literal blocks with a dynamic-programming pass: cost[i] is the size of the
+ * best encoding of the first i bytes, reached either by a run (2 bytes) or by a literal
+ * block (1 + n bytes) ending at i. Both minima are taken over sliding windows of at most
+ * MAX_RUN or MAX_LITERALS positions, so the pass is linear in the input size.
+ *
+ * @param data    Pointer to the data buffer to compress.
+ * @param length  Length of the data in bytes.
+ * @param output  Pointer to the output buffer where compressed data is written.
+ * @return        0 on success, 1 if memory allocation failed.
+ */
+int compress_optimal(const unsigned char *data, size_t length, struct emitter *output) {
+    uint32_t *cost = malloc((length + 1) * sizeof(*cost));
+    uint32_t *from = malloc((length + 1) * sizeof(*from));  // Start of the last block
+    unsigned char *run = malloc(length + 1);                // Whether that block is a run
+    if (!cost || !from || !run) {
+        perror("Memory allocation failed");
+        free(cost);
+        free(from);
+        free(run);
         return 1;
     }
-    fclose(input);
 
-    // Encrypt and compress data
-    encrypt(data, original_size);
-    compress(data, original_size, output);
+    struct window_min literals = { .head = 0, .tail = 0 };
+    struct window_min repeats = { .head = 0, .tail = 0 };
+    size_t run_start = 0;
 
-    // Calculate output file size and pad to the next sector if necessary
-    fflush(output);
-    fseek(output, 0, SEEK_END);
-    
-    unsigned int compressed_size = ftell(output);
-    unsigned int sectors = pad_to_sector(output, compressed_size);
+    cost[0] = 0;
+    for (size_t i = 1; i <= length; i++) {
+        size_t j = i - 1;                    // Newest block start
+        size_t oldest = i > MAX_LITERALS ? i - MAX_LITERALS : 0;
 
-    // Print summary of results
-    printf("Packing complete:\n");
-    printf("  Original size: %u bytes\n", original_size);
-    printf("  Compressed size: %u bytes\n", compressed_size);
-    printf("  Compression ratio: %.2f%%\n", (100.0 * compressed_size) / original_size);
-    printf("  Total sectors (512 bytes each): %u\n", sectors);
+        // A literal block j..i costs cost[j] + (i - j) + 1, so the window keeps cost[j] - j
+        window_push(&literals, oldest, j, (int64_t)cost[j] - (int64_t)j);
+        cost[i] = literals.key[literals.head % (MAX_LITERALS + 1)] + i + 1;
+        from[i] = literals.pos[literals.head % (MAX_LITERALS + 1)];
+        run[i] = 0;
 
-    fclose(output);
-    free(data);
+        // A run j..i needs data[j..i-1] to be equal, so the window restarts with each new byte
+        if (j > 0 && data[j] != data[j - 1]) {
+            repeats.head = repeats.tail;
+            run_start = j;
+        }
+        window_push(&repeats, oldest > run_start ? oldest : run_start, j, cost[j]);
+        if (repeats.key[repeats.head % (MAX_LITERALS + 1)] + 2 < cost[i]) {
+            cost[i] = repeats.key[repeats.head % (MAX_LITERALS + 1)] + 2;
+            from[i] = repeats.pos[repeats.head % (MAX_LITERALS + 1)];
+            run[i] = 1;
+        }
+    }
+
+    // Walk back from the end, leaving the end of each block in cost[] at its start
+    for (size_t i = length; i > 0; i = from[i]) {
+        cost[from[i]] = i;
+    }
+    for (size_t i = 0; i < length; i = cost[i]) {
+        size_t end = cost[i];
+        if (run[end]) {
+            emit_run(output, end - i, data[i] ^ XOR_KEY);
+        } else {
+            emit_literals(output, data + i, end - i);
+        }
+    }
+    emit_byte(output, 0);                    // Write end marker (zero control byte)
 
+    free(cost);
+    free(from);
+    free(run);
     return 0;
-}
\ No newline at end of file
+}
+
+/**
+ * Hashes the three bytes at 'p' for the LZ hash chains.
+ */
+static inline unsigned int lz_hash(const unsigned char *p) {
+    return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Adds the positions up to 'limit' to the hash chains.
+ *
+ * @param s      Pointer to the LZ encoder state.
+ * @param limit  Absolute position to hash up to (exclusive).
+ */
+static void lz_insert(struct lz_state *s, size_t limit) {
+    size_t hashable = s->end >= LZ_MIN_MATCH ? s->end - LZ_MIN_MATCH + 1 : 0;
+    if (limit > hashable) {
+        limit = hashable;                    // The last two bytes have no three-byte hash
+    }
+    for (; s->hashed < limit; s->hashed++) {
+        unsigned int h = lz_hash(s->buffer + (s->hashed - s->base));
+        s->prev[s->hashed % LZ_HISTORY] = s->head[h];
+        s->head[h] = s->hashed + 1;
+    }
+}
+
+/**
+ * Finds the longest earlier match for the bytes at absolute position 'pos'.
+ *
+ * Walks the hash chain for the three bytes at 'pos', newest candidate first, up to
+ * s->depth candidates within LZ_WINDOW bytes.
+ *
+ * @param s       Pointer to the LZ encoder state.
+ * @param pos     Absolute position to match.
+ * @param offset  Set to the offset of the longest match.
+ * @return        Length of the longest match (0 if shorter than LZ_MIN_MATCH).
+ */
+static size_t lz_find_match(struct lz_state *s, size_t pos, size_t *offset) {
+    size_t available = s->end - pos;
+    size_t limit = available < LZ_MAX_MATCH ? available : LZ_MAX_MATCH;
+    size_t best = 0;
+
+    if (limit < LZ_MIN_MATCH) {
+        return 0;
+    }
+
+    const unsigned char *current = s->buffer + (pos - s->base);
+    size_t candidate = s->head[lz_hash(current)];
+    for (unsigned int depth = 0; candidate != 0 && depth < s->depth; depth++) {
+        size_t match = candidate - 1;
+        if (match >= pos || pos - match > LZ_WINDOW) {
+            break;
+        }
+
+        const unsigned char *earlier = s->buffer + (match - s->base);
+        if (earlier[best] == current[best]) {
+            size_t length = 0;
+            while (length < limit && earlier[length] == current[length]) {
+                length++;
+            }
+            if (length > best) {
+                best = length;
+                *offset = pos - match;
+                if (best == limit) {
+                    break;
+                }
+            }
+        }
+        candidate = s->prev[match % LZ_HISTORY];
+    }
+    return best >= LZ_MIN_MATCH ? best : 0;
+}
+
+/**
+ * Writes the pending flag byte and tokens.
+ */
+static void lz_flush_group(struct lz_state *s, struct emitter *output) {
+    if (s->tokens > 0) {
+        if (emit_reserve(output, s->group_length) == 0) {
+            memcpy(output->data + output->length, s->group, s->group_length);
+            output->length += s->group_length;
+            output->total += s->group_length;
+        }
+    }
+    s->group[0] = 0;
+    s->group_length = 1;
+    s->tokens = 0;
+}
+
+/**
+ * Adds the end marker, a match token with a zero offset and length field, and writes
+ * the last token group.
+ */
+static void lz_finish_group(struct lz_state *s, struct emitter *output) {
+    s->group[s->group_length++] = 0;
+    s->group[s->group_length++] = 0;
+    s->tokens++;
+    lz_flush_group(s, output);
+}
+
+/**
+ * Adds a literal byte (encrypted) or a match to the pending token group.
+ *
+ * @param s       Pointer to the LZ encoder state.
+ * @param length  Match length, or 0 for a literal.
+ * @param value   Match offset, or the literal byte.
+ * @param output  Pointer to the output buffer where compressed data is written.
+ */
+static void lz_token(struct lz_state *s, size_t length, size_t value, struct emitter *output) {
+    if (length == 0) {
+        s->group[0] |= 1 << s->tokens;       // Literal
+        s->group[s->group_length++] = value ^ XOR_KEY;
+    } else {
+        size_t field = length >= LZ_LONG_MATCH ? 15 : length - LZ_MIN_MATCH;
+        size_t word = value | field << 12;
+        s->group[s->group_length++] = word & 0xff;
+        s->group[s->group_length++] = word >> 8;
+        if (field == 15) {
+            s->group[s->group_length++] = length - LZ_LONG_MATCH;
+        }
+    }
+    if (++s->tokens == 8) {
+        lz_flush_group(s, output);
+    }
+}
+
+/**
+ * Encodes buffered input while enough lookahead is available (all of it if 'final').
+ *
+ * Matching is greedy with a one-position lazy check: when the next position has a
+ * longer match, the current byte is written as a literal instead.
+ */
+static void lz_encode(struct lz_state *s, int final, struct emitter *output) {
+    size_t lookahead = final ? 1 : LZ_MAX_MATCH + 2;
+
+    while (s->pos < s->end && s->end - s->pos >= lookahead) {
+        size_t offset = 0;
+        lz_insert(s, s->pos);
+        size_t length = lz_find_match(s, s->pos, &offset);
+
+        if (length > 0 && length < LZ_MAX_MATCH) {
+            size_t next_offset;
+            lz_insert(s, s->pos + 1);
+            if (lz_find_match(s, s->pos + 1, &next_offset) > length) {
+                length = 0;                  // A longer match starts at the next byte
+            }
+        }
+
+        if (length == 0) {
+            lz_token(s, 0, s->buffer[s->pos - s->base], output);
+            s->pos++;
+        } else {
+            lz_token(s, length, offset, output);
+            s->pos += length;
+        }
+    }
+}
+
+/**
+ * Resets an LZ encoder state for a new input, so an encoder can be reused without
+ * allocating a new one. Only the hash heads need clearing: the chains are rebuilt from
+ * them, and the buffer is written before it is read.
+ *
+ * @param s  Pointer to the LZ encoder state.
+ */
+void lz_reset(struct lz_state *s) {
+    memset(s->head, 0, sizeof(s->head));
+    s->base = 0;
+    s->end = 0;
+    s->pos = 0;
+    s->hashed = 0;
+    s->depth = LZ_CHAIN_DEPTH;
+    s->group[0] = 0;
+    s->group_length = 1;
+    s->tokens = 0;
+}
+
+/**
+ * Initializes an LZ encoder state.
+ *
+ * @return  Pointer to the state, or NULL if allocation failed.
+ */
+struct lz_state *lz_create(void) {
+    struct lz_state *s = malloc(sizeof(*s));
+    if (s) {
+        lz_reset(s);
+    }
+    return s;
+}
+
+/**
+ * Copies as much input into the sliding buffer as fits.
+ *
+ * Slides the buffer first when it is full, keeping the match history and the bytes
+ * not yet encoded.
+ *
+ * @param s       Pointer to the LZ encoder state.
+ * @param data    Pointer to the input.
+ * @param length  Number of input bytes available.
+ * @return        Number of input bytes copied.
+ */
+static size_t lz_fill(struct lz_state *s, const unsigned char *data, size_t length) {
+    if (s->end - s->base == LZ_BUFFER_SIZE) {
+        size_t keep_from = s->pos > LZ_WINDOW ? s->pos - LZ_WINDOW : 0;
+        size_t shift = keep_from - s->base;
+        memmove(s->buffer, s->buffer + shift, s->end - keep_from);
+        s->base = keep_from;
+    }
+
+    size_t space = LZ_BUFFER_SIZE - (s->end - s->base);
+    size_t count = length < space ? length : space;
+    memcpy(s->buffer + (s->end - s->base), data, count);
+    s->end += count;
+    return count;
+}
+
+/**
+ * Compresses and encrypts the input data using LZSS and XOR.
+ *
+ * Repeated byte sequences are replaced by matches pointing back up to LZ_WINDOW bytes
+ * into the output, which suits program images far better than RLE. Only literal bytes
+ * are encrypted; matches copy output that is already decrypted. Like compress(), the
+ * input may be fed in several chunks with identical output.
+ *
+ * @param s       Pointer to the LZ encoder state (from lz_create()).
+ * @param data    Pointer to the data buffer to compress.
+ * @param length  Length of the data in bytes.
+ * @param output  Pointer to the output buffer where compressed data is written.
+ */
+void compress_lz(struct lz_state *s, const unsigned char *data, size_t length, struct emitter *output) {
+    while (length > 0) {
+        size_t count = lz_fill(s, data, length);
+        data += count;
+        length -= count;
+
+        lz_encode(s, 0, output);
+    }
+}
+
+/**
+ * Encodes the remaining input and terminates the compressed data with a zero match word.
+ *
+ * @param s       Pointer to the LZ encoder state.
+ * @param output  Pointer to the output buffer where compressed data is written.
+ */
+void compress_lz_finish(struct lz_state *s, struct emitter *output) {
+    lz_encode(s, 1, output);
+    lz_finish_group(s, output);
+}
+
+/**
+ * Records the longest match at every buffered position while enough lookahead is available
+ * (all of them if 'final'), for the optimal parse.
+ *
+ * After a match of LZ_MAX_MATCH (a long run or a repeated block) the positions it covers
+ * are skipped and left without a match, the usual shortcut that keeps long runs linear.
+ */
+static void lz_scan(struct lz_state *s, int final, uint16_t *lengths, uint16_t *offsets) {
+    size_t lookahead = final ? 1 : LZ_MAX_MATCH;
+
+    while (s->pos < s->end && s->end - s->pos >= lookahead) {
+        size_t offset = 0;
+        lz_insert(s, s->pos);
+        size_t length = lz_find_match(s, s->pos, &offset);
+
+        lengths[s->pos] = length;
+        offsets[s->pos] = offset;
+        if (length == LZ_MAX_MATCH) {
+            for (size_t i = 1; i < length; i++) {
+                lengths[s->pos + i] = 0;
+            }
+            s->pos += length;
+        } else {
+            s->pos++;
+        }
+    }
+}
+
+/**
+ * Compresses and encrypts the whole input with an optimal LZSS parse.
+ *
+ * The longest match at each position is found first (trying up to 'depth' candidates),
+ * then a dynamic-programming pass finds the cheapest path through the input: cost[i] is
+ * the size in bits of the best encoding of the first i bytes, where a literal costs 9
+ * bits and a match 17 (25 with the extra length byte), flag bits included. Any length
+ * from LZ_MIN_MATCH up to the longest match is considered at each position, which is
+ * where the greedy parse loses most.
+ *
+ * @param data    Pointer to the data buffer to compress.
+ * @param length  Length of the data in bytes.
+ * @param depth   Hash chain candidates tried per position.
+ * @param output  Pointer to the output buffer where compressed data is written.
+ * @return        0 on success, 1 if memory allocation failed.
+ */
+int compress_lz_optimal(const unsigned char *data, size_t length, unsigned int depth, struct emitter *output) {
+    struct lz_state *s = lz_create();
+    uint16_t *lengths = malloc((length + 1) * sizeof(*lengths));
+    uint16_t *offsets = malloc((length + 1) * sizeof(*offsets));
+    uint32_t *cost = malloc((length + 1) * sizeof(*cost));
+    uint16_t *from_length = malloc((length + 1) * sizeof(*from_length));
+    uint16_t *from_offset = malloc((length + 1) * sizeof(*from_offset));
+    if (!s || !lengths || !offsets || !cost || !from_length || !from_offset) {
+        perror("Memory allocation failed");
+        free(s);
+        free(lengths);
+        free(offsets);
+        free(cost);
+        free(from_length);
+        free(from_offset);
+        return 1;
+    }
+
+    s->depth = depth;
+    for (size_t done = 0; done < length;) {
+        done += lz_fill(s, data + done, length - done);
+        lz_scan(s, 0, lengths, offsets);
+    }
+    lz_scan(s, 1, lengths, offsets);
+
+    cost[0] = 0;
+    for (size_t i = 1; i <= length; i++) {
+        cost[i] = UINT32_MAX;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (cost[i] + 9 < cost[i + 1]) {     // Literal: flag bit and byte
+            cost[i + 1] = cost[i] + 9;
+            from_length[i + 1] = 1;
+        }
+        for (size_t l = LZ_MIN_MATCH; l <= lengths[i]; l++) {
+            uint32_t c = cost[i] + (l >= LZ_LONG_MATCH ? 25 : 17);
+            if (c < cost[i + l]) {
+                cost[i + l] = c;
+                from_length[i + l] = l;
+                from_offset[i + l] = offsets[i];
+            }
+        }
+    }
+
+    // Walk back from the end, leaving each token at the position it starts from
+    for (size_t i = length; i > 0; i -= from_length[i]) {
+        lengths[i - from_length[i]] = from_length[i];
+        offsets[i - from_length[i]] = from_offset[i];
+    }
+    for (size_t i = 0; i < length; i += lengths[i]) {
+        if (lengths[i] == 1) {
+            lz_token(s, 0, data[i], output);
+        } else {
+            lz_token(s, lengths[i], offsets[i], output);
+        }
+    }
+    lz_finish_group(s, output);
+
+    free(s);
+    free(lengths);
+    free(offsets);
+    free(cost);
+    free(from_length);
+    free(from_offset);
+    return 0;
+}
+
+/**
+ * Stores the input data as RLE literal blocks without looking for runs (CODEC_STORED).
+ *
+ * For blocks that do not compress, this skips the run and match search and writes them
+ * at MAX_LITERALS + 1 bytes per MAX_LITERALS. The literal blocks are collected in 'state'
+ * like those of compress(), so the input may be fed in chunks, and compress_finish() ends
+ * the data.
+ *
+ * @param state   Pointer to the encoder state (zero-initialized before the first chunk).
+ * @param data    Pointer to the data buffer to store.
+ * @param length  Length of the data in bytes.
+ * @param output  Pointer to the output buffer where the literal blocks are written.
+ */
+void store(struct rle_state *state, const unsigned char *data, size_t length, struct emitter *output) {
+    while (length > 0) {
+        size_t count = MAX_LITERALS - state->literals;
+        if (count > length) {
+            count = length;
+        }
+        memcpy(state->literal + state->literals, data, count);
+        state->literals += count;
+        data += count;
+        length -= count;
+        if (state->literals == MAX_LITERALS) {
+            flush_literals(state, output);
+        }
+    }
+}
+
+/**
+ * Selects the compression backend of an initialized encoder for a new input. An LZ state
+ * it already holds (see 'keep') is reset and reused instead of allocating another.
+ *
+ * @param enc    Pointer to the encoder.
+ * @param codec  CODEC_RLE, CODEC_LZ or CODEC_STORED.
+ * @return       0 on success, 1 on failure.
+ */
+int encoder_select(struct encoder *enc, int codec) {
+    memset(&enc->rle, 0, sizeof(enc->rle));
+    enc->codec = codec;
+    if (codec == CODEC_LZ) {
+        if (enc->lz) {
+            lz_reset(enc->lz);
+        } else if (!(enc->lz = lz_create())) {
+            perror("Memory allocation failed");
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Initializes the encoder for a compression backend.
+ *
+ * @param enc    Pointer to the encoder.
+ * @param codec  CODEC_RLE, CODEC_LZ or CODEC_STORED.
+ * @return       0 on success, 1 on failure.
+ */
+int encoder_init(struct encoder *enc, int codec) {
+    memset(enc, 0, sizeof(*enc));
+    return encoder_select(enc, codec);
+}
+
+/**
+ * Compresses the next chunk of input with the selected backend.
+ */
+void encode(struct encoder *enc, const unsigned char *data, size_t length, struct emitter *output) {
+    if (enc->codec == CODEC_LZ) {
+        compress_lz(enc->lz, data, length, output);
+    } else if (enc->codec == CODEC_STORED) {
+        store(&enc->rle, data, length, output);
+    } else {
+        compress(&enc->rle, data, length, output);
+    }
+}
+
+/**
+ * Writes everything still pending in the encoder and the end marker of the backend.
+ */
+void encode_finish(struct encoder *enc, struct emitter *output) {
+    if (enc->codec == CODEC_LZ) {
+        compress_lz_finish(enc->lz, output);
+    } else {
+        compress_finish(&enc->rle, output);
+    }
+    if (!enc->keep) {
+        free(enc->lz);
+        enc->lz = NULL;
+    }
+}
+
+/**
+ * Gathers the statistics of a block of input in a single sweep, a greedy parse of it as
+ * both RLE and LZSS would see it.
+ *
+ * A run of three or more equal bytes (measured with the vectorized run scanner) is an RLE run,
+ * and for LZSS a literal followed by matches at offset 1. Elsewhere every position is probed for
+ * an LZSS match against the latest earlier position with the same hash, a single candidate where
+ * the encoder tries LZ_CHAIN_DEPTH, so the matches found are a lower bound of the encoder's.
+ * Bytes outside runs are RLE literals, whether or not LZSS matches them.
+ *
+ * @param data    Pointer to the input.
+ * @param length  Length of the input in bytes.
+ * @param stats   Set to the statistics of the input.
+ */
+void analyze_block(const unsigned char *data, size_t length, struct block_stats *stats) {
+    uint32_t last[1 << PROBE_HASH_BITS];     // Latest position + 1 with each hash (0 if none)
+    size_t literals = 0;                     // RLE literals since the last run
+
+    memset(last, 0, sizeof(last));
+    memset(stats, 0, sizeof(*stats));
+    for (size_t i = 0; i < length;) {
+        if (i + 2 < length && data[i + 1] == data[i] && data[i + 2] == data[i]) {
+            size_t run = run_length(data + i, length - i, data[i]);
+            stats->runs += (run + MAX_RUN - 1) / MAX_RUN;
+            stats->run_bytes += run;
+            stats->literal_blocks += (literals + MAX_LITERALS - 1) / MAX_LITERALS;
+            literals = 0;
+
+            if (run - 1 >= LZ_MIN_MATCH) {   // The first byte, then copies of it
+                size_t matches = (run - 1 + LZ_MAX_MATCH - 1) / LZ_MAX_MATCH;
+                stats->lz_literals++;
+                stats->matches += matches;
+                stats->long_matches += run - 1 >= LZ_LONG_MATCH ? matches : 0;
+            } else {
+                stats->lz_literals += run;
+            }
+            i += run;
+            continue;
+        }
+
+        size_t match = 0;
+        if (i + LZ_MIN_MATCH <= length) {
+            unsigned int h = lz_hash(data + i) >> (LZ_HASH_BITS - PROBE_HASH_BITS);
+            size_t candidate = last[h];
+            last[h] = i + 1;
+            if (candidate != 0 && i - (candidate - 1) <= LZ_WINDOW) {
+                const unsigned char *earlier = data + candidate - 1;
+                size_t limit = length - i < LZ_MAX_MATCH ? length - i : LZ_MAX_MATCH;
+                while (match < limit && earlier[match] == data[i + match]) {
+                    match++;
+                }
+            }
+        }
+        if (match >= LZ_MIN_MATCH) {
+            stats->matches++;
+            stats->long_matches += match >= LZ_LONG_MATCH;
+        } else {
+            match = 1;
+            stats->lz_literals++;
+        }
+        literals += match;
+        i += match;
+    }
+    stats->literal_blocks += (literals + MAX_LITERALS - 1) / MAX_LITERALS;
+}
+
+/**
+ * Picks the codec of a block from its statistics ('--codec auto'): the one with the smallest
+ * estimated size, where
+ *
+ *   stored = every byte, plus a control byte per MAX_LITERALS
+ *   RLE    = 2 bytes per run, plus the literals and a control byte per literal block
+ *   LZSS   = a byte per literal, 2 per match (3 for a long one), and a flag bit per token
+ *
+ * On a tie the codec that decodes faster wins: stored (no encoding at all, for data such as
+ * compressed or random bytes), then RLE, then LZSS. The LZSS estimate errs on the large side
+ * (see analyze_block()), so a block goes to LZSS only when it clearly beats RLE.
+ *
+ * @param stats   Pointer to the statistics of the block.
+ * @param length  Length of the block in bytes.
+ * @return        CODEC_STORED, CODEC_RLE or CODEC_LZ.
+ */
+int choose_codec(const struct block_stats *stats, size_t length) {
+    size_t stored = length + (length + MAX_LITERALS - 1) / MAX_LITERALS;
+    size_t rle = 2 * stats->runs + (length - stats->run_bytes) + stats->literal_blocks;
+    size_t lz = stats->lz_literals + 2 * stats->matches + stats->long_matches +
+                (stats->lz_literals + stats->matches + 7) / 8;
+
+    if (stored <= rle && stored <= lz) {
+        return CODEC_STORED;
+    }
+    return rle <= lz ? CODEC_RLE : CODEC_LZ;
+}
+
+// Match search depths of the optimal LZSS parse levels, the last one tries every candidate
+static const unsigned int lz_optimal_depths[] = { LZ_CHAIN_DEPTH, 1024, LZ_WINDOW };
+
+/**
+ * Packs the whole input with increasing effort and keeps the smallest result ('--optimal').
+ *
+ * The payload is padded to whole sectors (see pad_to_sector()), so saved bytes only count
+ * once they take it below a sector boundary. The greedy parse runs first, then the optimal
+ * parses: for RLE the exact one, for LZSS one per depth in lz_optimal_depths (a stored block
+ * has none). It stops as
+ * soon as the payload needs fewer sectors than the greedy one did. A block of a block-parallel
+ * payload is not padded on its own, so it is packed without stopping early.
+ *
+ * @param data    Pointer to the input.
+ * @param length  Length of the input in bytes.
+ * @param enc     Pointer to the encoder (used for the greedy parse).
+ * @param output  Pointer to the output buffer, holding the header placeholder and the block index.
+ * @param level   Set to the level that was used (0 for the greedy parse).
+ * @param levels  Set to the number of optimal levels.
+ * @param padded  Whether the output is padded on its own (stop at the sector boundary).
+ * @return        0 on success, 1 on failure.
+ */
+int pack_optimal(const unsigned char *data, size_t length, struct encoder *enc, struct emitter *output,
+                 unsigned int *level, unsigned int *levels, int padded) {
+    struct emitter best, trial;
+
+    *level = 0;
+    *levels = enc->codec == CODEC_LZ ? sizeof(lz_optimal_depths) / sizeof(lz_optimal_depths[0])
+                                     : enc->codec == CODEC_RLE;  // Nothing to search for a stored block
+
+    if (emit_init(&best, EMIT_BUFFER_SIZE, NULL)) {
+        return 1;
+    }
+    encode(enc, data, length, &best);
+    encode_finish(enc, &best);
+    unsigned int greedy_sectors = (output->total + best.total + SECTOR_SIZE - 1) / SECTOR_SIZE;
+
+    for (unsigned int i = 1; i <= *levels; i++) {
+        if (emit_init(&trial, EMIT_BUFFER_SIZE, NULL)) {
+            free(best.data);
+            return 1;
+        }
+        int failed = enc->codec == CODEC_LZ ? compress_lz_optimal(data, length, lz_optimal_depths[i - 1], &trial)
+                                            : compress_optimal(data, length, &trial);
+        if (failed || trial.failed) {
+            free(trial.data);
+            free(best.data);
+            return 1;
+        }
+
+        if (trial.total < best.total) {
+            free(best.data);
+            best = trial;
+            *level = i;
+        } else {
+            free(trial.data);
+        }
+        if (padded && (output->total + best.total + SECTOR_SIZE - 1) / SECTOR_SIZE < greedy_sectors) {
+            break;                           // Dropped below the next sector boundary
+        }
+    }
+
+    if (emit_reserve(output, best.total) == 0) {
+        memcpy(output->data + output->length, best.data, best.total);
+        output->length += best.total;
+        output->total += best.total;
+    }
+    free(best.data);
+    return best.failed;
+}
+
+/**
+ * One block of the input in block-parallel mode, packed on its own.
+ */
+struct block {
+    const unsigned char *data;               // Input of the block
+    size_t length;                           // Length of the input
+    int codec;                               // Codec the block is packed with
+    struct emitter packed;                   // Packed block, end marker included
+    int failed;                              // Set when packing the block failed
+};
+
+/**
+ * Blocks shared by the worker threads, which take the next unpacked block until none are left.
+ */
+struct block_pool {
+    struct block *blocks;
+    size_t count;                            // Number of blocks
+    size_t next;                             // Next block to pack
+    int codec;                               // Compression backend, CODEC_AUTO to choose per block
+    int optimal;                             // Pack each block with pack_optimal()
+    pthread_mutex_t lock;                    // Protects 'next'
+};
+
+/**
+ * Worker thread, packs blocks from the pool until all are taken.
+ *
+ * Every block gets its own encoder, so it does not depend on earlier blocks and the
+ * blocks can be packed in any order. With CODEC_AUTO the codec of each block is chosen
+ * from its statistics (see choose_codec()), and the packed block starts with its codec.
+ *
+ * @param arg  Pointer to the block pool.
+ * @return     NULL.
+ */
+static void *pack_worker(void *arg) {
+    struct block_pool *pool = arg;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->count) {
+            break;
+        }
+
+        struct block *b = &pool->blocks[i];
+        b->codec = pool->codec;
+        if (b->codec == CODEC_AUTO) {
+            struct block_stats stats;
+            analyze_block(b->data, b->length, &stats);
+            b->codec = choose_codec(&stats, b->length);
+        }
+        struct encoder enc;
+        if (emit_init(&b->packed, b->length + b->length / 8 + 16, NULL) || encoder_init(&enc, b->codec)) {
+            b->failed = 1;
+            continue;
+        }
+        emit_byte(&b->packed, b->codec);
+        if (pool->optimal) {
+            unsigned int level, levels;
+            b->failed = pack_optimal(b->data, b->length, &enc, &b->packed, &level, &levels, 0);
+        } else {
+            encode(&enc, b->data, b->length, &b->packed);
+            encode_finish(&enc, &b->packed);
+            b->failed = b->packed.failed;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Returns the offset of the packed data in a payload, after the header and the block index.
+ *
+ * @param blocks  Number of blocks, 1 for a single stream.
+ * @return        Offset in bytes.
+ */
+size_t data_offset(size_t blocks) {
+    return HEADER_SIZE + 2 * (blocks + 1);
+}
+
+/**
+ * Writes the block index of a payload packed as a single stream: one block, which is ready
+ * once every sector is read (0 left to read), and INDEX_END. The stream then starts with
+ * its codec, like every block.
+ *
+ * @param output  Pointer to the output buffer, holding the header placeholder.
+ * @param codec   Codec of the stream.
+ */
+void emit_stream_index(struct emitter *output, int codec) {
+    emit_byte(output, 0);
+    emit_byte(output, 0);
+    emit_byte(output, INDEX_END & 0xff);
+    emit_byte(output, INDEX_END >> 8);
+    emit_byte(output, codec);
+}
+
+/**
+ * Packs the whole input as independent blocks of BLOCK_SIZE bytes on 'threads' threads.
+ *
+ * The blocks are written in order, each starting with the byte of its codec and ending with
+ * the end marker of the codec, after a block index with one little-endian word per block
+ * and INDEX_END. An entry is the number
+ * of payload sectors still to be read once the block is loaded completely, so the bootloader
+ * decodes a block as soon as its count of sectors left to read is down to the entry, without
+ * working out where the block ends. The index has to fit the first sector with the header.
+ *
+ * @param data     Pointer to the input.
+ * @param length   Length of the input in bytes.
+ * @param codec    Compression backend, or CODEC_AUTO to choose it per block.
+ * @param optimal  Whether to pack each block with pack_optimal().
+ * @param threads  Number of threads to pack on (the calling thread included).
+ * @param output   Pointer to the output buffer, holding the header placeholder.
+ * @param count    Set to the number of blocks.
+ * @param used     Set to the number of blocks packed with each codec (CODECS entries).
+ * @return         0 on success, 1 on failure.
+ */
+int pack_blocks(const unsigned char *data, size_t length, int codec, int optimal, unsigned int threads,
+                struct emitter *output, unsigned int *count, unsigned int *used) {
+    struct block_pool pool = { .count = (length + BLOCK_SIZE - 1) / BLOCK_SIZE, .next = 0, .codec = codec,
+                               .optimal = optimal };
+
+    *count = pool.count;
+    if (data_offset(pool.count) > SECTOR_SIZE) { // The bootloader reads the index with the header
+        fprintf(stderr, "Error: Input is too large for the block index (%zu blocks).\n", pool.count);
+        return 1;
+    }
+    pool.blocks = calloc(pool.count, sizeof(*pool.blocks));
+    pthread_t *workers = calloc(threads, sizeof(*workers));
+    if (!pool.blocks || !workers) {
+        perror("Memory allocation failed");
+        free(pool.blocks);
+        free(workers);
+        return 1;
+    }
+    for (size_t i = 0; i < pool.count; i++) {
+        pool.blocks[i].data = data + i * BLOCK_SIZE;
+        pool.blocks[i].length = length - i * BLOCK_SIZE < BLOCK_SIZE ? length - i * BLOCK_SIZE : BLOCK_SIZE;
+    }
+    pthread_mutex_init(&pool.lock, NULL);
+
+    // The calling thread packs blocks too, so one extra worker per further thread
+    unsigned int started = 0;
+    for (; started + 1 < threads && started + 1 < pool.count; started++) {
+        if (pthread_create(&workers[started], NULL, pack_worker, &pool) != 0) {
+            break;                           // Fewer threads, the running ones take the rest
+        }
+    }
+    pack_worker(&pool);
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+
+    // Write the block index and the blocks in input order
+    int failed = 0;
+    size_t end = output->total + 2 * (pool.count + 1), size = end;
+    memset(used, 0, CODECS * sizeof(*used));
+    for (size_t i = 0; i < pool.count; i++) {
+        failed |= pool.blocks[i].failed;
+        size += pool.blocks[i].packed.total;
+        used[pool.blocks[i].codec]++;
+    }
+    size_t sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    for (size_t i = 0; i < pool.count; i++) {
+        end += pool.blocks[i].packed.total;
+        size_t left = sectors - (end + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        emit_byte(output, left & 0xff);
+        emit_byte(output, left >> 8);
+    }
+    emit_byte(output, INDEX_END & 0xff);
+    emit_byte(output, INDEX_END >> 8);
+    for (size_t i = 0; i < pool.count; i++) {
+        struct block *b = &pool.blocks[i];
+        if (!b->failed && emit_reserve(output, b->packed.total) == 0) {
+            memcpy(output->data + output->length, b->packed.data, b->packed.total);
+            output->length += b->packed.total;
+            output->total += b->packed.total;
+        }
+        free(b->packed.data);
+    }
+    free(pool.blocks);
+    free(workers);
+
+    if (failed) {
+        fprintf(stderr, "Error: Packing a block failed.\n");
+    }
+    return failed || output->failed;
+}
+
+/**
+ * Encrypts and compresses the input file chunk by chunk through a fixed-size buffer.
+ *
+ * Memory use does not depend on the input size, and the input does not have to be
+ * seekable, so it may be a pipe or stdin. The output is identical to packing the
+ * whole file at once.
+ *
+ * @param input   Pointer to the input file.
+ * @param enc     Pointer to the encoder.
+ * @param output  Pointer to the output buffer where compressed data is written.
+ * @param length  Set to the number of input bytes packed.
+ * @param sum     Pointer to the checksums, the input is added chunk by chunk.
+ * @return        0 on success, 1 on failure.
+ */
+int pack_stream(FILE *input, struct encoder *enc, struct emitter *output, unsigned int *length,
+                struct checksum *sum) {
+    static unsigned char buffer[STREAM_CHUNK_SIZE];
+    size_t count;
+
+    *length = 0;
+    while ((count = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+        encode(enc, buffer, count, output);
+        checksum_update(sum, buffer, count);
+        *length += count;
+    }
+    if (ferror(input)) {
+        perror("Error reading input file");
+        return 1;
+    }
+
+    encode_finish(enc, output);
+    return 0;
+}
+
+/**
+ * Fills in the payload header.
+ *
+ * The header tells the bootloader how many sectors to read and how the disk is laid out,
+ * so it can read the payload a whole track at a time:
+ *
+ *   offset 0: header version (byte)
+ *   offset 1: sectors per track (byte)
+ *   offset 2: number of heads (byte)
+ *   offset 3: codec of every block, CODEC_RLE, CODEC_LZ or CODEC_STORED, CODEC_MIXED if they differ (byte)
+ *   offset 4: total payload sectors including the header sector (word, little-endian)
+ *   offset 6: number of independently packed blocks, 1 for a single stream (word)
+ *   offset 8: in-place safety margin in bytes, see margin_update() (word)
+ *   offset 10: segment to load the payload at, sector aligned (word)
+ *   offset 12: checksum seed of the unpacked application, see checksum_seed() (word)
+ *
+ * The header is followed by the block index (see pack_blocks() and emit_stream_index()).
+ *
+ * @param header            Pointer to the HEADER_SIZE bytes of the header.
+ * @param sectors           Total number of sectors in the payload.
+ * @param sectors_per_track Sectors per track of the boot disk.
+ * @param heads             Number of heads of the boot disk.
+ * @param codec             Codec of every block, or CODEC_MIXED.
+ * @param blocks            Number of blocks, 1 for a single stream.
+ * @param margin            In-place safety margin in bytes.
+ * @param load              Load segment of the payload.
+ * @param checksum          Checksum seed of the unpacked application.
+ */
+void write_header(unsigned char *header, unsigned int sectors, unsigned int sectors_per_track, unsigned int heads,
+                  int codec, unsigned int blocks, unsigned int margin, unsigned int load, unsigned int checksum) {
+    memset(header, 0, HEADER_SIZE);
+
+    header[0] = HEADER_VERSION;
+    header[1] = sectors_per_track;
+    header[2] = heads;
+    header[3] = codec;
+    header[4] = sectors & 0xff;
+    header[5] = sectors >> 8;
+    header[6] = blocks & 0xff;
+    header[7] = blocks >> 8;
+    header[8] = margin & 0xff;
+    header[9] = margin >> 8;
+    header[10] = load & 0xff;
+    header[11] = load >> 8;
+    header[12] = checksum & 0xff;
+    header[13] = checksum >> 8;
+}
+
+/**
+ * State of the in-place margin scan of a payload (see margin_update()), which reads the
+ * payload front to back in pieces of any size.
+ */
+struct margin_scan {
+    size_t in;                               // Payload bytes read
+    size_t out;                              // Output bytes decoded
+    long long lead;                          // Largest 'out - in' after a token
+    size_t start;                            // Offset of the packed data
+    unsigned int streams;                    // Streams not finished yet
+    enum {
+        SCAN_HEADER,                         // Header and block index, skipped
+        SCAN_CODEC,                          // Codec byte of the next stream
+        SCAN_RLE_CONTROL,
+        SCAN_RLE_LITERALS,                   // Literal bytes, 'skip' left
+        SCAN_RLE_RUN,                        // Byte value of a run
+        SCAN_LZ_FLAGS,
+        SCAN_LZ_TOKEN,                       // Literal, or first byte of a match word
+        SCAN_LZ_WORD,                        // Second byte of a match word
+        SCAN_LZ_LONG,                        // Extra length byte of a long match
+        SCAN_DONE                            // Every stream ended, the rest is padding
+    } state;
+    size_t skip;                             // Bytes left to skip in SCAN_HEADER or SCAN_RLE_LITERALS
+    unsigned int flags;                      // LZSS flag byte, shifted to the next token
+    unsigned int tokens;                     // LZSS tokens left in the group
+    unsigned int word;                       // First byte of a match word
+};
+
+/**
+ * Starts the in-place margin scan of a payload.
+ *
+ * @param m        Pointer to the scan state.
+ * @param start    Offset of the packed data (after the header and the block index).
+ * @param streams  Number of packed streams, one per block, each starting with its codec.
+ */
+void margin_init(struct margin_scan *m, size_t start, unsigned int streams) {
+    memset(m, 0, sizeof(*m));
+    m->lead = -(long long)start;
+    m->start = start;
+    m->streams = streams;
+    m->state = start > 0 ? SCAN_HEADER : SCAN_CODEC;
+    m->skip = start;
+}
+
+// Records the lead of the output over the payload once a token is read completely
+static inline void margin_token(struct margin_scan *m) {
+    if ((long long)m->out - (long long)m->in > m->lead) {
+        m->lead = (long long)m->out - (long long)m->in;
+    }
+}
+
+// Ends the current stream, after its end marker
+static inline void margin_end_stream(struct margin_scan *m) {
+    margin_token(m);
+    m->state = --m->streams > 0 ? SCAN_CODEC : SCAN_DONE;
+}
+
+// Moves on to the next token of an LZSS group
+static inline void margin_next_token(struct margin_scan *m) {
+    m->flags >>= 1;
+    m->state = --m->tokens > 0 ? SCAN_LZ_TOKEN : SCAN_LZ_FLAGS;
+}
+
+/**
+ * Reads the next piece of a payload into the in-place margin scan.
+ *
+ * The bootloader loads the payload at the tail of the memory the application is unpacked
+ * to and decodes it forward into the same region, so the output must never overtake the
+ * packed bytes not read yet. Every token is read before its output is written, so this
+ * walks the tokens of every stream and tracks how far the output offset gets ahead of the
+ * payload offset after a token (see margin_finish()). The bytes of literal blocks are
+ * skipped rather than read one by one.
+ *
+ * @param m       Pointer to the scan state.
+ * @param data    Pointer to the next bytes of the payload, from the start of the payload on.
+ * @param length  Number of bytes.
+ */
+void margin_update(struct margin_scan *m, const unsigned char *data, size_t length) {
+    for (size_t i = 0; i < length && m->state != SCAN_DONE;) {
+        if (m->state == SCAN_HEADER || m->state == SCAN_RLE_LITERALS) {
+            size_t count = m->skip < length - i ? m->skip : length - i;
+            m->skip -= count;
+            m->in += count;
+            i += count;
+            if (m->skip == 0) {
+                if (m->state == SCAN_RLE_LITERALS) {
+                    margin_token(m);
+                }
+                m->state = m->state == SCAN_HEADER ? SCAN_CODEC : SCAN_RLE_CONTROL;
+            }
+            continue;
+        }
+
+        unsigned int byte = data[i++];
+        m->in++;
+        switch (m->state) {
+        case SCAN_CODEC:
+            m->state = byte == CODEC_LZ ? SCAN_LZ_FLAGS : SCAN_RLE_CONTROL;
+            break;
+        case SCAN_RLE_CONTROL:
+            if (byte == 0) {
+                margin_end_stream(m);        // End marker
+            } else if (byte & LITERAL_FLAG) {
+                m->out += byte & ~LITERAL_FLAG;
+                m->skip = byte & ~LITERAL_FLAG;
+                if (m->skip > 0) {
+                    m->state = SCAN_RLE_LITERALS;
+                } else {
+                    margin_token(m);
+                }
+            } else {
+                m->out += byte;              // Run
+                m->state = SCAN_RLE_RUN;
+            }
+            break;
+        case SCAN_RLE_RUN:
+            margin_token(m);
+            m->state = SCAN_RLE_CONTROL;
+            break;
+        case SCAN_LZ_FLAGS:
+            m->flags = byte;
+            m->tokens = 8;
+            m->state = SCAN_LZ_TOKEN;
+            break;
+        case SCAN_LZ_TOKEN:
+            if (m->flags & 1) {
+                m->out++;                    // Literal
+                margin_token(m);
+                margin_next_token(m);
+            } else {
+                m->word = byte;
+                m->state = SCAN_LZ_WORD;
+            }
+            break;
+        case SCAN_LZ_WORD:
+            m->word |= byte << 8;
+            if ((m->word & 0xfff) == 0) {
+                margin_end_stream(m);        // End marker
+            } else if ((m->word >> 12) == 15) {
+                m->state = SCAN_LZ_LONG;
+            } else {
+                m->out += (m->word >> 12) + LZ_MIN_MATCH;
+                margin_token(m);
+                margin_next_token(m);
+            }
+            break;
+        case SCAN_LZ_LONG:
+            m->out += LZ_LONG_MATCH + byte;
+            margin_token(m);
+            margin_next_token(m);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/**
+ * Returns the in-place safety margin of a scanned payload: the payload has to end at least
+ * the largest lead plus the padded payload size minus the unpacked size past the start of
+ * the region.
+ *
+ * @param m         Pointer to the scan state, after every byte of the payload.
+ * @param length    Size of the payload in bytes (padded to sectors).
+ * @param unpacked  Size of the unpacked application in bytes.
+ * @return          Bytes the payload has to end after the unpacked application (0 or more).
+ */
+size_t margin_finish(const struct margin_scan *m, size_t length, size_t unpacked) {
+    long long margin = m->lead + (long long)length - (long long)unpacked;
+    return margin > 0 ? margin : 0;
+}
+
+/**
+ * Decodes one RLE stream of a payload, following the rules of the bootloader's 'unpack'.
+ *
+ * Runs are written with memset(), once their byte is read. Literal blocks are copied a byte
+ * at a time forwards, each byte read and decrypted just before it is written, exactly like
+ * the bootloader's 'lodsb' and 'stosb' loop: the output may be in the same buffer as the
+ * payload, before it, as in the bootloader (see unpack_file()), and a literal block the output
+ * has caught up with reads back the bytes it just wrote, as it would at boot, where an
+ * overlap-safe copy would hide the overlap.
+ *
+ * @param payload   Pointer to the payload.
+ * @param length    Size of the payload in bytes.
+ * @param in        Offset of the stream, set to the offset after its end marker.
+ * @param output    Pointer to the output buffer.
+ * @param capacity  Size of the output buffer in bytes.
+ * @param out       Offset to write to, set to the offset after the decoded stream.
+ * @return          0 on success, 1 if the stream is malformed.
+ */
+static int unpack_rle(const unsigned char *payload, size_t length, size_t *in, unsigned char *output,
+                      size_t capacity, size_t *out) {
+    size_t i = *in, o = *out;
+
+    for (;;) {
+        if (i >= length) {
+            return 1;                        // No end marker
+        }
+        unsigned int control = payload[i++];
+        if (control == 0) {
+            break;                           // End marker
+        }
+        if (control & LITERAL_FLAG) {
+            size_t count = control & ~LITERAL_FLAG;
+            if (count == 0 || count > length - i || count > capacity - o) {
+                return 1;                    // The bootloader would copy 65536 bytes for a count of 0
+            }
+            for (size_t k = 0; k < count; k++) {
+                output[o++] = payload[i++] ^ XOR_KEY;
+            }
+        } else {
+            if (i >= length || control > capacity - o) {
+                return 1;
+            }
+            memset(output + o, payload[i++] ^ XOR_KEY, control);
+            o += control;
+        }
+    }
+
+    *in = i;
+    *out = o;
+    return 0;
+}
+
+/**
+ * Decodes one LZSS stream of a payload, following the rules of the bootloader's 'unpack_lz'.
+ *
+ * Matches at least as far back as they are long are copied with memcpy(), closer ones a
+ * byte at a time so that they repeat like the bootloader's 'rep movsb'.
+ *
+ * @param payload   Pointer to the payload.
+ * @param length    Size of the payload in bytes.
+ * @param in        Offset of the stream, set to the offset after its end marker.
+ * @param output    Pointer to the output buffer.
+ * @param capacity  Size of the output buffer in bytes.
+ * @param out       Offset to write to, set to the offset after the decoded stream.
+ * @return          0 on success, 1 if the stream is malformed.
+ */
+static int unpack_lz(const unsigned char *payload, size_t length, size_t *in, unsigned char *output,
+                     size_t capacity, size_t *out) {
+    size_t i = *in, o = *out;
+
+    for (;;) {
+        if (i >= length) {
+            return 1;                        // No end marker
+        }
+        unsigned int flags = payload[i++] | 0x100; // Above a marker bit that ends the group
+        for (; flags != 1; flags >>= 1) {
+            if (flags & 1) {
+                if (i >= length || o >= capacity) {
+                    return 1;
+                }
+                output[o++] = payload[i++] ^ XOR_KEY;
+                continue;
+            }
+
+            if (length - i < 2) {
+                return 1;
+            }
+            unsigned int word = payload[i] | payload[i + 1] << 8;
+            i += 2;
+            size_t offset = word & 0xfff;
+            if (offset == 0) {
+                *in = i;                     // End marker
+                *out = o;
+                return 0;
+            }
+            size_t count = (word >> 12) + LZ_MIN_MATCH;
+            if (count == LZ_LONG_MATCH) {
+                if (i >= length) {
+                    return 1;
+                }
+                count += payload[i++];
+            }
+            if (offset > o || count > capacity - o) {
+                return 1;                    // Before the start of the output, or past its end
+            }
+            if (offset >= count) {
+                memcpy(output + o, output + o - offset, count);
+            } else {
+                for (size_t k = 0; k < count; k++) {
+                    output[o + k] = output[o + k - offset];
+                }
+            }
+            o += count;
+        }
+    }
+}
+
+/**
+ * Decodes a packed payload the way the bootloader does.
+ *
+ * The number of blocks comes from the header. The streams (one per block, or a single one)
+ * follow the header and the block index back to back, each starting with the byte of its
+ * codec and ending with the end marker of the codec, and are decoded one after another
+ * into 'output', a stored stream with the RLE decoder as in the bootloader. The
+ * output is then checked against the checksum seed in the header, as the bootloader does.
+ *
+ * @param payload   Pointer to the payload, header included.
+ * @param length    Size of the payload in bytes.
+ * @param output    Pointer to the output buffer.
+ * @param capacity  Size of the output buffer in bytes.
+ * @param unpacked  Set to the number of bytes decoded.
+ * @return          0 on success, 1 if the payload is malformed or does not fit 'output', 2 if
+ *                  the output does not match the checksum.
+ */
+int unpack_payload(const unsigned char *payload, size_t length, unsigned char *output, size_t capacity,
+                   size_t *unpacked) {
+    if (length < HEADER_SIZE) {
+        return 1;
+    }
+    unsigned int blocks = payload[6] | payload[7] << 8;
+    struct checksum sum = { payload[12], payload[13], 0 }; // Before the output overwrites it in place
+    size_t in = data_offset(blocks), out = 0;
+    if (blocks == 0 || in > length) {
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < blocks; i++) {
+        if (in >= length) {
+            return 1;
+        }
+        int codec = payload[in++];
+        int failed = codec == CODEC_LZ ? unpack_lz(payload, length, &in, output, capacity, &out)
+                                       : unpack_rle(payload, length, &in, output, capacity, &out);
+        if (failed) {
+            return 1;
+        }
+    }
+
+    checksum_update(&sum, output, out);
+    *unpacked = out;
+    return sum.a != 0 || sum.b != 0 ? 2 : 0;
+}
+
+/**
+ * Reads a whole file into memory.
+ *
+ * @param input   The file, positioned at its start.
+ * @param length  Size of the file in bytes.
+ * @return        Pointer to the contents, or NULL on failure.
+ */
+unsigned char *read_all(FILE *input, size_t length) {
+    unsigned char *data = malloc(length ? length : 1);
+    if (!data) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    if (fread(data, 1, length, input) != length) {
+        perror("Error reading input file");
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/**
+ * Maps a whole input file read-only, to be read front to back (MADV_SEQUENTIAL).
+ *
+ * The pages belong to the page cache, shared with every other packer mapping the same
+ * input, instead of being copied into a buffer of their own. A file that cannot be mapped
+ * (an empty one, say) is read into memory with read_all() instead.
+ *
+ * @param input   The file, positioned at its start.
+ * @param length  Size of the file in bytes.
+ * @param mapped  Set to 1 if the contents are mapped, 0 if they were read into memory.
+ * @return        Pointer to the contents, or NULL on failure.
+ */
+unsigned char *map_input(FILE *input, size_t length, int *mapped) {
+    *mapped = 0;
+    if (length > 0) {
+        void *data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fileno(input), 0);
+        if (data != MAP_FAILED) {
+            madvise(data, length, MADV_SEQUENTIAL);
+            *mapped = 1;
+            return data;
+        }
+    }
+    return read_all(input, length);
+}
+
+/**
+ * Releases the contents of an input file returned by map_input().
+ */
+void release_input(unsigned char *data, size_t length, int mapped) {
+    if (mapped) {
+        munmap(data, length);
+    } else {
+        free(data);
+    }
+}
+
+/**
+ * Reads a packed payload file and decodes it the way the bootloader would ('--unpack', '--verify').
+ *
+ * The header has to match this packer, the file has to hold exactly the sectors the header
+ * counts, and the payload has to load at its segment between DECODE_ADDR and LOAD_LIMIT. It
+ * is then decoded in place in a model of the bootloader's memory: loaded at its segment and
+ * unpacked to DECODE_ADDR in the same buffer, so a margin too small for the output to stay
+ * behind the packed bytes not read yet corrupts the result just as it would at boot.
+ *
+ * @param path      Path of the payload file.
+ * @param unpacked  Set to the size of the decoded application in bytes.
+ * @param memory    Set to the memory model (LOAD_LIMIT bytes), to be freed by the caller.
+ * @return          Pointer to the decoded application (at DECODE_ADDR in the model), or NULL on failure.
+ */
+unsigned char *unpack_file(const char *path, size_t *unpacked, unsigned char **memory) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror("Error opening packed file");
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *payload = read_all(file, size);
+    fclose(file);
+    if (!payload) {
+        return NULL;
+    }
+
+    // Check the header and the load window
+    if (size < SECTOR_SIZE || payload[0] != HEADER_VERSION) {
+        fprintf(stderr, "Error: '%s' is not a payload of this packer (header version %u).\n", path,
+                size ? payload[0] : 0);
+        free(payload);
+        return NULL;
+    }
+    size_t sectors = payload[4] | payload[5] << 8;
+    size_t blocks = payload[6] | payload[7] << 8;
+    size_t load = (payload[10] | payload[11] << 8) * 16;
+    if (sectors * SECTOR_SIZE != size || blocks == 0 || data_offset(blocks) > SECTOR_SIZE) {
+        fprintf(stderr, "Error: Payload header does not match the file (%zu sectors in %zu bytes, %zu blocks).\n",
+                sectors, size, blocks);
+        free(payload);
+        return NULL;
+    }
+    if (load < DECODE_ADDR || load % SECTOR_SIZE != 0 || load + size > LOAD_LIMIT) {
+        fprintf(stderr, "Error: Payload does not fit the load window (0x%05zx-0x%05zx, at most 0x%05x-0x%05x).\n",
+                load, load + size, DECODE_ADDR, LOAD_LIMIT);
+        free(payload);
+        return NULL;
+    }
+
+    // Load the payload at its segment and decode it in place
+    *memory = calloc(LOAD_LIMIT, 1);
+    if (!*memory) {
+        perror("Memory allocation failed");
+        free(payload);
+        return NULL;
+    }
+    memcpy(*memory + load, payload, size);
+    free(payload);
+    int failed = unpack_payload(*memory + load, size, *memory + DECODE_ADDR, LOAD_LIMIT - DECODE_ADDR, unpacked);
+    if (failed) {
+        fprintf(stderr, failed == 2 ? "Error: Payload is corrupt, it does not match its checksum.\n"
+                                    : "Error: Payload is corrupt, it does not decode within the load window.\n");
+        free(*memory);
+        *memory = NULL;
+        return NULL;
+    }
+    return *memory + DECODE_ADDR;
+}
+
+/**
+ * Checks that a packed payload decodes back to its input at boot ('--verify').
+ *
+ * @param input_path   Path of the input file.
+ * @param packed_path  Path of the payload file.
+ * @return             0 if the payload decodes to the input, 1 otherwise.
+ */
+int verify(const char *input_path, const char *packed_path) {
+    FILE *input = fopen(input_path, "rb");
+    if (!input) {
+        perror("Error opening input file");
+        return 1;
+    }
+    fseek(input, 0, SEEK_END);
+    size_t length = ftell(input);
+    fseek(input, 0, SEEK_SET);
+    unsigned char *data = read_all(input, length);
+    fclose(input);
+    if (!data) {
+        return 1;
+    }
+
+    unsigned char *memory;
+    size_t unpacked;
+    unsigned char *output = unpack_file(packed_path, &unpacked, &memory);
+    if (!output) {
+        free(data);
+        return 1;
+    }
+
+    int failed = unpacked != length || memcmp(output, data, length) != 0;
+    if (failed) {
+        size_t first = 0;
+        while (first < length && first < unpacked && output[first] == data[first]) {
+            first++;
+        }
+        fprintf(stderr, "Error: Payload decodes to %zu bytes that differ from the %zu input bytes at offset %zu.\n",
+                unpacked, length, first);
+    } else {
+        printf("Verified: %s decodes to %s (%zu bytes)\n", packed_path, input_path, length);
+    }
+    free(memory);
+    free(data);
+    return failed;
+}
+
+/**
+ * Decodes a packed payload file back into the application ('--unpack').
+ *
+ * @param packed_path  Path of the payload file.
+ * @param output_path  Path of the file to write the application to.
+ * @return             0 on success, 1 on failure.
+ */
+int unpack(const char *packed_path, const char *output_path) {
+    unsigned char *memory;
+    size_t unpacked;
+    unsigned char *data = unpack_file(packed_path, &unpacked, &memory);
+    if (!data) {
+        return 1;
+    }
+
+    FILE *output = fopen(output_path, "wb");
+    if (!output) {
+        perror("Error opening output file");
+        free(memory);
+        return 1;
+    }
+    int failed = fwrite(data, 1, unpacked, output) != unpacked;
+    if (fclose(output) != 0 || failed) {
+        fprintf(stderr, "Error: Writing the output file failed.\n");
+        failed = 1;
+    } else {
+        printf("Unpacked %zu bytes to %s\n", unpacked, output_path);
+    }
+    free(memory);
+    return failed;
+}
+
+/**
+ * Works out the format of a packed payload from its header and its tokens.
+ *
+ * Walks the tokens of every stream the way margin_update() does, the control bytes, flag
+ * bytes and match words are not encrypted. The codec is the one of every block: CODEC_LZ,
+ * CODEC_RLE (stored blocks included, the RLE decoder handles them), or CODEC_AUTO if
+ * the blocks need both decoders.
+ *
+ * @param payload  Pointer to the payload, header included.
+ * @param length   Size of the payload in bytes.
+ * @param format   Set to the format of the payload.
+ * @return         0 on success, 1 if the payload is malformed.
+ */
+int scan_format(const unsigned char *payload, size_t length, struct payload_format *format) {
+    memset(format, 0, sizeof(*format));
+    format->sectors_per_track = payload[1];
+    format->heads = payload[2];
+    format->sectors = payload[4] | payload[5] << 8;
+    format->blocks = payload[6] | payload[7] << 8;
+    size_t in = data_offset(format->blocks);
+    if (format->blocks == 0 || in > length) {
+        return 1;
+    }
+
+    for (unsigned int i = 0; i < format->blocks; i++) {
+        if (in >= length) {
+            return 1;
+        }
+        int codec = payload[in++] == CODEC_LZ ? CODEC_LZ : CODEC_RLE;
+        format->codec = i == 0 || format->codec == codec ? codec : CODEC_AUTO;
+        int end = 0;
+        while (!end) {
+            if (in >= length) {
+                return 1;                    // No end marker
+            }
+            if (codec == CODEC_LZ) {
+                unsigned int flags = payload[in++];
+                for (int token = 0; token < 8 && !end; token++, flags >>= 1) {
+                    if (flags & 1) {
+                        format->literals = 1;
+                        in++;
+                    } else if (length - in < 2) {
+                        return 1;
+                    } else {
+                        size_t word = payload[in] | payload[in + 1] << 8;
+                        in += 2;
+                        if ((word & 0xfff) == 0) {
+                            end = 1;         // End marker
+                        } else if ((word >> 12) == 15) {
+                            format->long_matches = 1;
+                            in++;
+                        }
+                    }
+                }
+            } else {
+                unsigned char control = payload[in++];
+                if (control == 0) {
+                    end = 1;                 // End marker
+                } else if (control & LITERAL_FLAG) {
+                    format->literals = 1;
+                    in += control & ~LITERAL_FLAG;
+                } else {
+                    format->runs = 1;
+                    in++;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/**
+ * Writes a line of the format include: a NASM define with its comment.
+ */
+static void format_define(FILE *output, const char *name, int value, const char *comment) {
+    fprintf(output, "%%define %-19s %-5d ; %s\n", name, value, comment);
+}
+
+/**
+ * Writes the format of a packed payload as a NASM include for the bootloader ('--format').
+ *
+ * Assembled with the include ('nasm -p <format file> boot.asm'), the bootloader decodes
+ * only what the payload holds: the decoder of the other codec and the tokens that never
+ * occur are left out, and the geometry, the sector count and a single block are constants
+ * instead of header fields. Such a bootloader boots that payload, or one packed the same way.
+ *
+ * @param packed_path  Path of the payload file.
+ * @param format_path  Path of the include to write.
+ * @return             0 on success, 1 on failure.
+ */
+int write_format(const char *packed_path, const char *format_path) {
+    FILE *file = fopen(packed_path, "rb");
+    if (!file) {
+        perror("Error opening packed file");
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    unsigned char *payload = read_all(file, size);
+    fclose(file);
+    if (!payload) {
+        return 1;
+    }
+
+    struct payload_format format;
+    if (size < SECTOR_SIZE || payload[0] != HEADER_VERSION || scan_format(payload, size, &format)) {
+        fprintf(stderr, "Error: '%s' is not a payload of this packer.\n", packed_path);
+        free(payload);
+        return 1;
+    }
+    free(payload);
+
+    FILE *output = fopen(format_path, "w");
+    if (!output) {
+        perror("Error opening format file");
+        return 1;
+    }
+    fprintf(output, "; Payload format of '%s', written by 'packer --format'\n", packed_path);
+    fprintf(output, "; Assemble the bootloader with 'nasm -p %s' to decode only this format\n", format_path);
+    format_define(output, "FORMAT_CODEC", format.codec,
+                  format.codec == CODEC_LZ    ? "Compression backend (CODEC_LZ)"
+                  : format.codec == CODEC_RLE ? "Compression backend (CODEC_RLE)"
+                                              : "Compression backend (either, chosen per block)");
+    format_define(output, "FORMAT_XOR_KEY", XOR_KEY, "XOR encryption key, 0 for none");
+    format_define(output, "FORMAT_SECTORS", format.sectors, "Payload sectors, the header sector included");
+    format_define(output, "FORMAT_SPT", format.sectors_per_track, "Sectors per track");
+    format_define(output, "FORMAT_HEADS", format.heads, "Number of heads");
+    format_define(output, "FORMAT_BLOCKS", format.blocks, "Number of packed blocks");
+    format_define(output, "FORMAT_RUNS", format.runs, "RLE runs occur");
+    format_define(output, "FORMAT_LITERALS", format.literals, "RLE literal blocks or LZSS literals occur");
+    format_define(output, "FORMAT_LONG_MATCHES", format.long_matches, "LZSS matches with an extra length byte occur");
+    if (fclose(output) != 0) {
+        fprintf(stderr, "Error: Writing the format file failed.\n");
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Reads the bootloader of a disk image and checks that it is a boot sector ('--image').
+ *
+ * The BIOS loads the first sector alone, so the bootloader has to be exactly one sector
+ * (anything past it would never be loaded) and end with the boot signature.
+ *
+ * @param path    Path of the bootloader.
+ * @param sector  Set to the boot sector (SECTOR_SIZE bytes).
+ * @return        0 on success, 1 on failure.
+ */
+int read_boot_sector(const char *path, unsigned char *sector) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        perror("Error opening bootloader");
+        return 1;
+    }
+    unsigned char extra;
+    size_t size = fread(sector, 1, SECTOR_SIZE, file);
+    size += fread(&extra, 1, 1, file);
+    fclose(file);
+
+    if (size != SECTOR_SIZE) {
+        fprintf(stderr, "Error: Bootloader '%s' is not exactly one sector (%d bytes).\n", path, SECTOR_SIZE);
+        return 1;
+    }
+    if ((sector[510] | sector[511] << 8) != BOOT_SIGNATURE) {
+        fprintf(stderr, "Error: Bootloader '%s' does not end with the boot signature (0x%04x).\n", path,
+                BOOT_SIGNATURE);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Copies a packed application into a disk image, in the file's own sectors.
+ *
+ * @param input   The packed file, positioned after its header sector.
+ * @param first   The header sector, already read.
+ * @param output  The disk image.
+ * @param size    Size of the packed file in bytes.
+ * @return        0 on success, 1 on failure.
+ */
+static int copy_payload(FILE *input, const unsigned char *first, FILE *output, size_t size) {
+    static unsigned char buffer[STREAM_CHUNK_SIZE];
+    if (fwrite(first, 1, SECTOR_SIZE, output) != SECTOR_SIZE) {
+        return 1;
+    }
+    for (size_t left = size - SECTOR_SIZE; left > 0;) {
+        size_t chunk = left < sizeof(buffer) ? left : sizeof(buffer);
+        if (fread(buffer, 1, chunk, input) != chunk || fwrite(buffer, 1, chunk, output) != chunk) {
+            return 1;
+        }
+        left -= chunk;
+    }
+    return 0;
+}
+
+/**
+ * Builds a bootable disk image from a bootloader and packed applications ('--image').
+ *
+ * The image is written front to back in a single pass: the boot sector, the directory, the
+ * second stage of a two-stage loader ('--stage2', padded to whole sectors) and the
+ * applications one after another from there on, read a header sector ahead for the
+ * directory and then copied through a fixed-size buffer. The rest of the disk is left to
+ * ftruncate(), so it is a hole in the file rather than written zeros.
+ *
+ * The directory starts with the LBA and the CHS position (CX, then the head) of the selected
+ * application, followed by the number of entries and the selected entry, and from offset
+ * DIRECTORY_ENTRIES on an entry per application: the LBA (word), the cylinder and sector as
+ * CX for a CHS read (word), the head, the codec and the number of sectors (word). The CHS
+ * positions use the geometry in the payload headers, which has to be the same for all, and
+ * for a hard disk image ('--hdd') that of the disk: the bootloader reads the first payload
+ * sector by CHS even when it reads the rest by LBA.
+ * Byte DIRECTORY_STAGE2 holds the number of second stage sectors, 0 for a single stage.
+ *
+ * @param count  Number of arguments.
+ * @param args   Options ('--hdd', '--select <entry>', '--stage2 <file>'), the bootloader, the packed applications
+ *               and the output image.
+ * @return       0 on success, 1 on failure.
+ */
+int build_image(int count, char *args[]) {
+    int hdd = 0;
+    unsigned int select = 0;
+    const char *stage2_path = NULL;
+
+    // Parse options
+    int arg = 0;
+    for (; arg < count && args[arg][0] == '-'; arg++) {
+        if (strcmp(args[arg], "--hdd") == 0) {
+            hdd = 1;
+        } else if (strcmp(args[arg], "--stage2") == 0 && arg + 1 < count) {
+            stage2_path = args[++arg];
+        } else if (strcmp(args[arg], "--select") == 0 && arg + 1 < count) {
+            arg++;
+            if (sscanf(args[arg], "%u", &select) != 1) {
+                fprintf(stderr, "Error: Invalid entry '%s'.\n", args[arg]);
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Error: Unknown image option '%s'.\n", args[arg]);
+            return 1;
+        }
+    }
+    int entries = count - arg - 2;
+    if (entries < 1) {
+        fprintf(stderr, "Usage: packer --image [--hdd] [--select <entry>] [--stage2 <second stage>] <bootloader> "
+                        "<packed file>... <output image>\n");
+        return 1;
+    }
+    const char *boot_path = args[arg];
+    char **paths = args + arg + 1;
+    const char *image_path = args[count - 1];
+    if (entries > DIRECTORY_MAX_ENTRIES) {
+        fprintf(stderr, "Error: The directory holds at most %d applications.\n", DIRECTORY_MAX_ENTRIES);
+        return 1;
+    }
+    if (select >= (unsigned int)entries) {
+        fprintf(stderr, "Error: Entry %u is not one of the %d applications.\n", select, entries);
+        return 1;
+    }
+
+    unsigned char boot[SECTOR_SIZE];
+    if (read_boot_sector(boot_path, boot)) {
+        return 1;
+    }
+
+    // Read the second stage, padded to whole sectors
+    unsigned char stage2[STAGE2_MAX_SECTORS * SECTOR_SIZE] = {0};
+    size_t stage2_sectors = 0;
+    if (stage2_path) {
+        FILE *file = fopen(stage2_path, "rb");
+        if (!file) {
+            perror("Error opening second stage");
+            return 1;
+        }
+        size_t size = fread(stage2, 1, sizeof(stage2), file);
+        int more = fgetc(file) != EOF;
+        fclose(file);
+        if (size == 0 || more) {
+            fprintf(stderr, "Error: Second stage '%s' is empty or more than %d sectors.\n", stage2_path,
+                    STAGE2_MAX_SECTORS);
+            return 1;
+        }
+        stage2_sectors = (size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    }
+
+    // Open every application, check its header and lay it out in the directory
+    unsigned char directory[SECTOR_SIZE] = {0};
+    unsigned char (*headers)[SECTOR_SIZE] = malloc(entries * sizeof(*headers));
+    FILE **inputs = calloc(entries, sizeof(*inputs));
+    size_t *sizes = malloc(entries * sizeof(*sizes));
+    int failed = !headers || !inputs || !sizes;
+    if (failed) {
+        perror("Memory allocation failed");
+    }
+    size_t lba = FIRST_PAYLOAD_LBA + stage2_sectors;
+    unsigned int sectors_per_track = 0, heads = 0;
+    for (int i = 0; i < entries && !failed; i++) {
+        failed = 1;
+        inputs[i] = fopen(paths[i], "rb");
+        if (!inputs[i]) {
+            perror("Error opening packed file");
+            break;
+        }
+        fseek(inputs[i], 0, SEEK_END);
+        sizes[i] = ftell(inputs[i]);
+        fseek(inputs[i], 0, SEEK_SET);
+        unsigned char *header = headers[i];
+        if (sizes[i] < SECTOR_SIZE || fread(header, 1, SECTOR_SIZE, inputs[i]) != SECTOR_SIZE ||
+            header[0] != HEADER_VERSION) {
+            fprintf(stderr, "Error: '%s' is not a payload of this packer.\n", paths[i]);
+            break;
+        }
+        size_t sectors = header[4] | header[5] << 8;
+        if (sectors * SECTOR_SIZE != sizes[i]) {
+            fprintf(stderr, "Error: Payload header of '%s' does not match the file (%zu sectors in %zu bytes).\n",
+                    paths[i], sectors, sizes[i]);
+            break;
+        }
+        if (i == 0) {
+            sectors_per_track = header[1];
+            heads = header[2];
+            if (hdd && (sectors_per_track != HDD_SECTORS_PER_TRACK || heads != HDD_HEADS)) {
+                fprintf(stderr, "Error: '%s' is packed for the geometry %u,%u, a hard disk image needs "
+                                "'--geometry %d,%d'.\n", paths[i], sectors_per_track, heads, HDD_SECTORS_PER_TRACK,
+                        HDD_HEADS);
+                break;
+            }
+            if (FIRST_PAYLOAD_LBA + stage2_sectors > sectors_per_track) {
+                fprintf(stderr, "Error: The second stage (%zu sectors) does not fit the first track after the "
+                                "directory (%u sectors per track).\n", stage2_sectors, sectors_per_track);
+                break;
+            }
+        } else if (header[1] != sectors_per_track || header[2] != heads) {
+            fprintf(stderr, "Error: '%s' is packed for another disk geometry (%u,%u instead of %u,%u).\n",
+                    paths[i], header[1], header[2], sectors_per_track, heads);
+            break;
+        }
+        if (lba + sectors > MAX_PAYLOAD_LBA) {
+            fprintf(stderr, "Error: '%s' does not fit within the first %d sectors.\n", paths[i], MAX_PAYLOAD_LBA);
+            break;
+        }
+        if ((lba + sectors - 1) / (sectors_per_track * heads) > MAX_CHS_CYLINDER) {
+            fprintf(stderr, "Error: '%s' ends past cylinder %d of its geometry (%u,%u), which the bootloader "
+                            "cannot read by CHS.\n", paths[i], MAX_CHS_CYLINDER, sectors_per_track, heads);
+            break;
+        }
+
+        // CHS position of the first sector, CL holds the sector and bits 8-9 of the cylinder
+        unsigned int cylinder = lba / (sectors_per_track * heads);
+        unsigned int cx = (cylinder & 0xff) << 8 | (cylinder >> 2 & 0xc0) | (lba % sectors_per_track + 1);
+        unsigned char *entry = directory + DIRECTORY_ENTRIES + i * DIRECTORY_ENTRY_SIZE;
+        entry[0] = lba & 0xff;
+        entry[1] = lba >> 8;
+        entry[2] = cx & 0xff;
+        entry[3] = cx >> 8;
+        entry[4] = lba / sectors_per_track % heads;
+        entry[5] = header[3];            // Codec
+        entry[6] = sectors & 0xff;
+        entry[7] = sectors >> 8;
+        if ((unsigned int)i == select) {
+            memcpy(directory, entry, 5);     // The selected application's LBA, CX and head
+        }
+        lba += sectors;
+        failed = 0;
+    }
+    directory[5] = entries;
+    directory[6] = select;
+    directory[DIRECTORY_STAGE2] = stage2_sectors;
+
+    // Size of the disk
+    size_t disk = FLOPPY_SECTORS;
+    if (hdd) {
+        size_t cylinder = HDD_HEADS * HDD_SECTORS_PER_TRACK;
+        disk = (lba + cylinder - 1) / cylinder * cylinder;
+    } else if (!failed && lba > FLOPPY_SECTORS) {
+        fprintf(stderr, "Error: The applications need %zu sectors, more than a 1.44 MB floppy holds.\n", lba);
+        failed = 1;
+    }
+
+    // Write the image in one pass, and leave the rest of the disk as a hole
+    if (!failed) {
+        FILE *image = fopen(image_path, "wb");
+        if (!image) {
+            perror("Error opening output image");
+            failed = 1;
+        } else {
+            failed = fwrite(boot, 1, SECTOR_SIZE, image) != SECTOR_SIZE ||
+                     fwrite(directory, 1, SECTOR_SIZE, image) != SECTOR_SIZE ||
+                     fwrite(stage2, 1, stage2_sectors * SECTOR_SIZE, image) != stage2_sectors * SECTOR_SIZE;
+            for (int i = 0; i < entries && !failed; i++) {
+                failed = copy_payload(inputs[i], headers[i], image, sizes[i]);
+            }
+            failed |= fflush(image) != 0 || ftruncate(fileno(image), (off_t)disk * SECTOR_SIZE) != 0;
+            failed |= fclose(image) != 0;
+            if (failed) {
+                fprintf(stderr, "Error: Writing the output image failed.\n");
+            }
+        }
+    }
+    if (!failed) {
+        printf("%s image created: %s (%d applications, booting entry %u)\n", hdd ? "Hard disk" : "Floppy disk",
+               image_path, entries, select);
+    }
+
+    for (int i = 0; inputs && i < entries; i++) {
+        if (inputs[i]) {
+            fclose(inputs[i]);
+        }
+    }
+    free(inputs);
+    free(headers);
+    free(sizes);
+    return failed;
+}
+
+/**
+ * Reads the payload back from the output file, for streaming mode where it was flushed already.
+ *
+ * @param file    The output file (opened for update).
+ * @param length  Size of the payload in bytes.
+ * @return        Pointer to the payload, or NULL on failure.
+ */
+unsigned char *read_back(FILE *file, size_t length) {
+    unsigned char *data = malloc(length);
+    if (!data) {
+        perror("Memory allocation failed");
+        return NULL;
+    }
+    if (fflush(file) != 0 || fseek(file, 0, SEEK_SET) != 0 || fread(data, 1, length, file) != length) {
+        fprintf(stderr, "Error: Reading back the output file failed.\n");
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/**
+ * Scans a payload that was flushed to the output file already for its in-place margin (see
+ * margin_update()), reading it back a chunk at a time, so streaming mode keeps to its
+ * fixed-size buffers however large the payload.
+ *
+ * @param file    The output file (opened for update).
+ * @param length  Size of the payload in bytes.
+ * @param m       Pointer to the started scan.
+ * @return        0 on success, 1 on failure.
+ */
+int scan_back(FILE *file, size_t length, struct margin_scan *m) {
+    static unsigned char buffer[STREAM_CHUNK_SIZE];
+
+    if (fflush(file) != 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "Error: Reading back the output file failed.\n");
+        return 1;
+    }
+    while (length > 0) {
+        size_t count = length < sizeof(buffer) ? length : sizeof(buffer);
+        if (fread(buffer, 1, count, file) != count) {
+            fprintf(stderr, "Error: Reading back the output file failed.\n");
+            return 1;
+        }
+        margin_update(m, buffer, count);
+        length -= count;
+    }
+    return 0;
+}
+
+/**
+ * Pads the output to ensure its size is a multiple of 512 bytes (SECTOR_SIZE).
+ *
+ * @param output    Pointer to the output buffer to pad.
+ * @return          The total size of the output in sectors after padding.
+ */
+unsigned int pad_to_sector(struct emitter *output) {
+    size_t padding_needed = SECTOR_SIZE - (output->total % SECTOR_SIZE);
+    if (padding_needed != SECTOR_SIZE) {
+        emit_fill(output, 0, padding_needed); // Pad with zeros
+    }
+    return output->total / SECTOR_SIZE;
+}
+
+/**
+ * Packs an input held whole in memory into a payload, all but the header: the header
+ * placeholder, the block index and the packed data, as a single stream or in blocks
+ * (see pack_blocks()). '--codec auto' chooses the codec of a single stream from the
+ * statistics of the whole input.
+ *
+ * @param data     Pointer to the input.
+ * @param length   Length of the input in bytes.
+ * @param options  Packing options (not streaming).
+ * @param enc      Pointer to the encoder for a single stream, initialized or zeroed.
+ * @param output   Pointer to the output buffer, empty.
+ * @param result   Set to the size of the input, the blocks and their codecs and the parse level.
+ * @return         0 on success, 1 on failure.
+ */
+int pack_input(const unsigned char *data, size_t length, const struct pack_options *options, struct encoder *enc,
+               struct emitter *output, struct pack_result *result) {
+    memset(result, 0, sizeof(*result));
+    result->original_size = length;
+    result->blocks = 1;
+
+    // Reserve room for the header, it is filled in once the sector count is known
+    emit_fill(output, 0, HEADER_SIZE);
+
+    if (options->threads >= 0) {
+        // Compress and encrypt independent blocks in parallel
+        return pack_blocks(data, length, options->codec, options->optimal, options->threads, output,
+                           &result->blocks, result->used);
+    }
+
+    int codec = options->codec;
+    if (codec == CODEC_AUTO) {
+        struct block_stats stats;
+        analyze_block(data, length, &stats);
+        codec = choose_codec(&stats, length);
+    }
+    if (encoder_select(enc, codec)) {
+        return 1;
+    }
+    emit_stream_index(output, codec);
+    result->used[codec]++;
+
+    if (options->optimal) {
+        // Try the slower parses until one saves a sector
+        return pack_optimal(data, length, enc, output, &result->level, &result->levels, 1);
+    }
+
+    // Compress and encrypt data in a single pass
+    encode(enc, data, length, output);
+    encode_finish(enc, output);
+    return 0;
+}
+
+/**
+ * Returns the codec for the header of a payload: the codec of every block, or CODEC_MIXED.
+ *
+ * @param result  Pointer to the result of packing the payload.
+ * @return        CODEC_RLE, CODEC_LZ, CODEC_STORED or CODEC_MIXED.
+ */
+int payload_codec(const struct pack_result *result) {
+    for (int c = 0; c < CODECS; c++) {
+        if (result->used[c] == result->blocks) {
+            return c;                        // Every block has the same codec
+        }
+    }
+    return CODEC_MIXED;
+}
+
+/**
+ * Finishes a packed payload: pads it to whole sectors, works out where the bootloader loads
+ * it for in-place decoding and fills in the header, which the caller writes over the
+ * placeholder.
+ *
+ * @param packed   Pointer to the output buffer holding the payload.
+ * @param output   The output file a streaming payload was flushed to, to read it back from
+ *                 (unused if the payload is all in the buffer).
+ * @param sum      Checksums of the input.
+ * @param options  Packing options (the geometry).
+ * @param result   Holding the size of the input, the blocks and their codecs, and set to the
+ *                 sizes, sectors and margin of the payload.
+ * @param header   Set to the HEADER_SIZE bytes of the header.
+ * @return         0 on success, 1 on failure.
+ */
+int finish_payload(struct emitter *packed, FILE *output, const struct checksum *sum,
+                   const struct pack_options *options, struct pack_result *result, unsigned char *header) {
+    if (result->original_size == 0) {
+        fprintf(stderr, "Error: Input file is empty.\n");
+        return 1;
+    }
+
+    // The packed size is known from the buffer, pad to the next sector if necessary
+    result->compressed_size = packed->total;
+    result->sectors = pad_to_sector(packed);
+
+    if (result->sectors > 0xffff) {
+        fprintf(stderr, "Error: Packed output is too large (%u sectors).\n", result->sectors);
+        return 1;
+    }
+
+    // Work out where the payload is loaded for in-place decoding, from the finished payload
+    struct margin_scan scan;
+    margin_init(&scan, data_offset(result->blocks), result->blocks);
+    if (packed->total == packed->length) {
+        margin_update(&scan, packed->data, packed->total);
+    } else {
+        emit_flush(packed);                  // Streaming mode, scan the payload back from the file
+        if (scan_back(output, packed->total, &scan)) {
+            return 1;
+        }
+    }
+    size_t margin = margin_finish(&scan, packed->total, result->original_size);
+    size_t region = result->original_size + margin; // Unpacked application and margin
+    size_t load = 0;                         // Load position after DECODE_ADDR, sector aligned so no
+    if (region > packed->total) {            // sector read crosses a 64 KiB DMA boundary
+        load = (region - packed->total + SECTOR_SIZE - 1) / SECTOR_SIZE * SECTOR_SIZE;
+    }
+    result->margin = margin;
+
+    if (margin > 0xffff || DECODE_ADDR + load + packed->total > LOAD_LIMIT) {
+        fprintf(stderr, "Error: Payload does not fit the bootloader's memory layout (%u bytes unpacked, %u "
+                        "sectors loaded after a %zu byte margin, %zu bytes in all, at most %u).\n",
+                        result->original_size, result->sectors, margin, load + packed->total,
+                        LOAD_LIMIT - DECODE_ADDR);
+        return 1;
+    }
+
+    // Fill in the header with the final sector count
+    write_header(header, result->sectors, options->sectors_per_track, options->heads, payload_codec(result), result->blocks,
+                 margin, (DECODE_ADDR + load) / 16, checksum_seed(sum));
+    return 0;
+}
+
+/**
+ * Adds bytes to a 64-bit FNV-1a hash.
+ *
+ * @param hash    The hash so far (FNV_OFFSET_BASIS to start).
+ * @param data    Bytes to add.
+ * @param length  Number of bytes.
+ * @return        The updated hash.
+ */
+uint64_t fnv1a_update(uint64_t hash, const unsigned char *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ data[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/**
+ * Works out the path of the cached payload for an input and the options it is packed with.
+ *
+ * The key hashes the options first, then the input file read in fixed-size chunks, so it
+ * costs a read of the input and no more memory in streaming mode.
+ *
+ * @param cache_dir   Directory of the cache.
+ * @param input_path  Path of the input file.
+ * @param options     Every option that changes the payload, with the packer build.
+ * @param path        Set to the path of the cached payload.
+ * @param size        Size of the path buffer.
+ * @return            0 on success, 1 if the input cannot be read.
+ */
+int cache_path(const char *cache_dir, const char *input_path, const char *options, char *path, size_t size) {
+    FILE *input = fopen(input_path, "rb");
+    if (!input) {
+        return 1;
+    }
+    static unsigned char buffer[STREAM_CHUNK_SIZE];
+    uint64_t hash = fnv1a_update(FNV_OFFSET_BASIS, (const unsigned char *)options, strlen(options) + 1);
+    size_t got;
+    while ((got = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+        hash = fnv1a_update(hash, buffer, got);
+    }
+    int failed = ferror(input);
+    fclose(input);
+    snprintf(path, size, "%s/%016llx.bin", cache_dir, (unsigned long long)hash);
+    return failed;
+}
+
+/**
+ * Copies a file, through a temporary file next to the destination that is renamed into
+ * place, so an interrupted copy never leaves a partial payload in the cache.
+ *
+ * @param from  Path of the file to copy.
+ * @param to    Path of the copy.
+ * @return      0 on success, 1 on failure.
+ */
+int copy_file(const char *from, const char *to) {
+    char temporary[4096];
+    snprintf(temporary, sizeof(temporary), "%s.%ld.tmp", to, (long)getpid());
+    FILE *input = fopen(from, "rb");
+    if (!input) {
+        return 1;
+    }
+    FILE *output = fopen(temporary, "wb");
+    if (!output) {
+        fclose(input);
+        return 1;
+    }
+    static unsigned char buffer[STREAM_CHUNK_SIZE];
+    size_t got;
+    int failed = 0;
+    while (!failed && (got = fread(buffer, 1, sizeof(buffer), input)) > 0) {
+        failed = fwrite(buffer, 1, got, output) != got;
+    }
+    failed |= ferror(input);
+    fclose(input);
+    failed |= fclose(output) != 0;
+    if (failed || rename(temporary, to) != 0) {
+        remove(temporary);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Packing modes run by the benchmark, with the options they stand for.
+ */
+enum bench_mode { BENCH_GREEDY, BENCH_STREAM, BENCH_OPTIMAL, BENCH_BLOCKS, BENCH_BLOCKS_OPTIMAL, BENCH_MODES };
+
+static const char *const bench_mode_names[BENCH_MODES] = {
+    "greedy", "stream", "optimal", "blocks", "blocks-optimal"
+};
+
+// Codecs run by the benchmark: every backend, and the per-block choice the build scripts use
+static const int bench_codecs[] = { CODEC_RLE, CODEC_LZ, CODEC_STORED, CODEC_AUTO };
+static const char *const bench_codec_names[] = { "rle", "lz", "stored", "auto" };
+
+/**
+ * Returns a monotonic time in seconds.
+ */
+static double bench_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * Writes a string as a JSON string literal.
+ */
+static void json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(out, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(out, "\\u%04x", *c);
+        } else {
+            fputc(*c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/**
+ * Packs the input once in one of the benchmark modes, into a finished payload with its header.
+ * In streaming mode the payload stays in the temporary file it was flushed to, so that the
+ * mode keeps to its fixed-size buffers.
+ *
+ * @param data     Pointer to the input (unused in streaming mode).
+ * @param length   Length of the input in bytes.
+ * @param input    The input file, read again in streaming mode.
+ * @param codec    Compression backend, or CODEC_AUTO outside streaming mode.
+ * @param mode     Packing mode.
+ * @param threads  Number of threads for the block modes.
+ * @param payload  Set to the payload, NULL in streaming mode.
+ * @param flushed  Set to the temporary file holding the payload in streaming mode, NULL otherwise.
+ * @param size     Set to the size of the payload in bytes (padded to sectors).
+ * @return         0 on success, 1 on failure.
+ */
+static int bench_pack(const unsigned char *data, size_t length, FILE *input, int codec, enum bench_mode mode,
+                      unsigned int threads, unsigned char **payload, FILE **flushed, size_t *size) {
+    int blocks = mode == BENCH_BLOCKS || mode == BENCH_BLOCKS_OPTIMAL;
+    struct pack_options options = { DEFAULT_SECTORS_PER_TRACK, DEFAULT_HEADS, codec, mode == BENCH_STREAM,
+                                    mode == BENCH_OPTIMAL || mode == BENCH_BLOCKS_OPTIMAL, blocks ? (int)threads : -1 };
+    struct pack_result result = { .blocks = 1 };
+    struct emitter packed;
+    struct encoder enc = { .codec = CODEC_RLE };
+    struct checksum sum = { 0, 0, 0 };
+    FILE *flush = NULL;
+    int failed;
+
+    if (mode == BENCH_STREAM && (!(flush = tmpfile()) || fseek(input, 0, SEEK_SET) != 0)) {
+        perror("Error opening a temporary file");
+        if (flush) {
+            fclose(flush);
+        }
+        return 1;
+    }
+    if (emit_init(&packed, EMIT_BUFFER_SIZE, flush)) {
+        if (flush) {
+            fclose(flush);
+        }
+        return 1;
+    }
+
+    if (mode == BENCH_STREAM) {
+        failed = encoder_init(&enc, codec);
+        if (!failed) {
+            emit_fill(&packed, 0, HEADER_SIZE);
+            emit_stream_index(&packed, codec);
+            result.used[codec]++;
+            failed = pack_stream(input, &enc, &packed, &result.original_size, &sum);
+        }
+    } else {
+        checksum_update(&sum, data, length);
+        failed = pack_input(data, length, &options, &enc, &packed, &result);
+    }
+    free(enc.lz);
+
+    unsigned int sectors = pad_to_sector(&packed);
+    unsigned char header[HEADER_SIZE];
+    write_header(header, sectors, DEFAULT_SECTORS_PER_TRACK, DEFAULT_HEADS, payload_codec(&result), result.blocks, 0, 0,
+                 checksum_seed(&sum));
+    *payload = NULL;
+    *flushed = NULL;
+    *size = packed.total;
+    if (flush) {
+        emit_flush(&packed);                 // Streaming mode, patch the header in the file
+        free(packed.data);
+        if (failed || packed.failed || fseek(flush, 0, SEEK_SET) != 0 ||
+            fwrite(header, 1, HEADER_SIZE, flush) != HEADER_SIZE) {
+            fclose(flush);
+            return 1;
+        }
+        *flushed = flush;
+        return 0;
+    }
+    if (failed || packed.failed) {
+        free(packed.data);
+        return 1;
+    }
+    memcpy(packed.data, header, HEADER_SIZE);
+    *payload = packed.data;
+    return 0;
+}
+
+/**
+ * Benchmarks one codec and mode on one input file and writes the result as a JSON object.
+ *
+ * Runs in a process of its own (see benchmark()), so that the peak resident set size it
+ * reports belongs to this run alone. It is taken once encoding is done, before the input and
+ * the payload are read whole for decoding in streaming mode, so it is the packer's own peak in
+ * that mode.
+ * Encoding and decoding are each repeated for at least BENCH_MIN_SECONDS, and the speeds
+ * are input (unpacked) megabytes (10^6 bytes) per second. The packed size and the ratio are
+ * those of the payload as written, header and sector padding included.
+ *
+ * @param path     Path of the input file.
+ * @param codec    Compression backend, or CODEC_AUTO outside streaming mode.
+ * @param mode     Packing mode.
+ * @param threads  Number of threads for the block modes.
+ * @param out      File to write the JSON object to.
+ * @return         0 on success, 1 on failure, 2 if the payload did not decode back to the input.
+ */
+static int bench_run(const char *path, int codec, enum bench_mode mode, unsigned int threads, FILE *out) {
+    FILE *input = fopen(path, "rb");
+    if (!input) {
+        perror("Error opening input file");
+        return 1;
+    }
+    fseek(input, 0, SEEK_END);
+    size_t length = ftell(input);
+    fseek(input, 0, SEEK_SET);
+
+    if (length == 0) {
+        fprintf(stderr, "Error: Input file '%s' is empty.\n", path);
+        fclose(input);
+        return 1;
+    }
+
+    // The input is only held in memory while encoding when the mode packs it whole
+    unsigned char *data = NULL;
+    if (mode != BENCH_STREAM && !(data = read_all(input, length))) {
+        fclose(input);
+        return 1;
+    }
+
+    // Time the encoder
+    unsigned char *payload = NULL;
+    FILE *flushed = NULL;
+    size_t size = 0;
+    unsigned int encodes = 0;
+    double start = bench_now(), encode_seconds;
+    do {
+        free(payload);
+        if (flushed) {
+            fclose(flushed);
+        }
+        if (bench_pack(data, length, input, codec, mode, threads, &payload, &flushed, &size)) {
+            free(data);
+            fclose(input);
+            return 1;
+        }
+        encodes++;
+    } while ((encode_seconds = bench_now() - start) < BENCH_MIN_SECONDS);
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    if (mode == BENCH_STREAM && fseek(input, 0, SEEK_SET) == 0) {
+        data = read_all(input, length);
+    }
+    fclose(input);
+    if (flushed) {
+        payload = read_back(flushed, size);  // Streaming mode, read the payload in for decoding only
+        fclose(flushed);
+    }
+    if (!data || !payload) {
+        free(data);
+        free(payload);
+        return 1;
+    }
+
+    // Time the decoder
+    unsigned char *unpacked = malloc(length);
+    size_t unpacked_size = 0;
+    unsigned int decodes = 0;
+    int failed = !unpacked;
+    double decode_seconds = 0;
+    start = bench_now();
+    while (!failed) {
+        failed = unpack_payload(payload, size, unpacked, length, &unpacked_size);
+        decodes++;
+        if ((decode_seconds = bench_now() - start) >= BENCH_MIN_SECONDS) {
+            break;
+        }
+    }
+    int round_trip = !failed && unpacked_size == length && memcmp(unpacked, data, length) == 0;
+
+    const char *codec_name = "";
+    for (size_t c = 0; c < sizeof(bench_codecs) / sizeof(bench_codecs[0]); c++) {
+        if (bench_codecs[c] == codec) {
+            codec_name = bench_codec_names[c];
+        }
+    }
+    fprintf(out, "    {\"file\": ");
+    json_string(out, path);
+    fprintf(out, ", \"codec\": \"%s\", \"mode\": \"%s\", \"threads\": %u,\n", codec_name,
+            bench_mode_names[mode], mode == BENCH_BLOCKS || mode == BENCH_BLOCKS_OPTIMAL ? threads : 1);
+    fprintf(out, "     \"original_bytes\": %zu, \"packed_bytes\": %zu, \"sectors\": %zu, \"ratio\": %.4f,\n",
+            length, size, size / SECTOR_SIZE, (double)size / length);
+    fprintf(out, "     \"encode_mb_per_s\": %.3f, \"encode_runs\": %u, \"decode_mb_per_s\": %.3f, "
+                 "\"decode_runs\": %u,\n", length * encodes / encode_seconds / 1e6, encodes,
+            failed ? 0.0 : length * decodes / decode_seconds / 1e6, decodes);
+    fprintf(out, "     \"peak_rss_kib\": %ld, \"round_trip\": %s}", usage.ru_maxrss, round_trip ? "true" : "false");
+
+    free(unpacked);
+    free(payload);
+    free(data);
+    return round_trip ? 0 : 2;
+}
+
+/**
+ * Benchmarks every codec and packing mode on every input file ('--benchmark').
+ *
+ * Writes a JSON array to stdout with one object per file, codec and mode (see bench_run()),
+ * leaving out the block modes for inputs too large for the block index. The codecs are RLE,
+ * LZSS, stored and '--codec auto', which the build scripts use (not in streaming mode, which
+ * cannot choose per block). Each run is forked off so that its memory use can be measured on
+ * its own, and hands its object back through a pipe, of whatever length.
+ *
+ * @param count  Number of input files.
+ * @param paths  Paths of the input files.
+ * @return       0 on success, 1 if any run failed or did not decode back to its input.
+ */
+int benchmark(int count, char *paths[]) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int threads = cpus > 0 ? cpus : 1;
+    int failed = 0, first = 1;
+
+    if (count == 0) {
+        fprintf(stderr, "Error: No input files to benchmark.\n");
+        return 1;
+    }
+
+    printf("[\n");
+    for (int i = 0; i < count; i++) {
+        struct stat info;
+        if (stat(paths[i], &info) != 0) {
+            perror("Error opening input file");
+            failed = 1;
+            continue;
+        }
+        size_t blocks = ((size_t)info.st_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+        for (size_t c = 0; c < sizeof(bench_codecs) / sizeof(bench_codecs[0]); c++) {
+            int codec = bench_codecs[c];
+            for (int mode = 0; mode < BENCH_MODES; mode++) {
+                if ((mode == BENCH_BLOCKS || mode == BENCH_BLOCKS_OPTIMAL) && data_offset(blocks) > SECTOR_SIZE) {
+                    continue;                // Too large for the block index
+                }
+                if (mode == BENCH_STREAM && codec == CODEC_AUTO) {
+                    continue;                // Chosen from the whole input, which streaming does not hold
+                }
+
+                int fds[2];
+                fflush(stdout);
+                if (pipe(fds) != 0) {
+                    perror("Error creating a pipe");
+                    return 1;
+                }
+                pid_t pid = fork();
+                if (pid < 0) {
+                    perror("Error starting a benchmark run");
+                    return 1;
+                }
+                if (pid == 0) {
+                    close(fds[0]);
+                    FILE *out = fdopen(fds[1], "w");
+                    int result = out ? bench_run(paths[i], codec, mode, threads, out) : 1;
+                    if (out && fclose(out) != 0) {
+                        result = 1;
+                    }
+                    _exit(result);
+                }
+
+                // Pass the object on once the run has finished, a failed round trip included (read
+                // whole, the buffer grows with long paths)
+                close(fds[1]);
+                size_t length = 0, capacity = 1024;
+                char *record = malloc(capacity);
+                ssize_t n = 0;
+                while (record && (n = read(fds[0], record + length, capacity - 1 - length)) > 0) {
+                    length += n;
+                    if (capacity - 1 - length == 0) {
+                        char *grown = realloc(record, capacity *= 2);
+                        if (!grown) {
+                            free(record);
+                        }
+                        record = grown;
+                    }
+                }
+                close(fds[0]);
+                if (!record || n < 0) {
+                    perror("Error reading a benchmark result");
+                    failed = 1;
+                }
+
+                int status;
+                waitpid(pid, &status, 0);
+                if (record && n == 0 && WIFEXITED(status) && (WEXITSTATUS(status) == 0 || WEXITSTATUS(status) == 2)) {
+                    record[length] = '\0';
+                    printf("%s%s", first ? "" : ",\n", record);
+                    first = 0;
+                }
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    failed = 1;
+                }
+                free(record);
+            }
+        }
+    }
+    printf("\n]\n");
+    return failed;
+}
+
+/**
+ * Parses one of the packing options of the command line, which the entries of a batch manifest
+ * take too: '--geometry', '--codec', '--stream', '--optimal' and '--threads'.
+ *
+ * @param count    Number of arguments.
+ * @param args     The arguments.
+ * @param arg      Index of the option, advanced past its value if it takes one.
+ * @param options  Updated with the option.
+ * @return         1 if the option was parsed, 0 if it is none of these, -1 if its value is invalid.
+ */
+int parse_pack_option(int count, char *args[], int *arg, struct pack_options *options) {
+    const char *option = args[*arg];
+
+    if (strcmp(option, "--stream") == 0) {
+        options->stream = 1;
+        return 1;
+    } else if (strcmp(option, "--optimal") == 0) {
+        options->optimal = 1;
+        return 1;
+    } else if (*arg + 1 >= count) {
+        return 0;                            // The other options take a value
+    }
+
+    const char *value = args[*arg + 1];
+    if (strcmp(option, "--threads") == 0) {
+        if (sscanf(value, "%d", &options->threads) != 1 || options->threads < 0) {
+            fprintf(stderr, "Error: Invalid thread count '%s'.\n", value);
+            return -1;
+        }
+        if (options->threads == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            options->threads = cpus > 0 ? cpus : 1;
+        }
+    } else if (strcmp(option, "--codec") == 0) {
+        if (strcmp(value, "rle") == 0) {
+            options->codec = CODEC_RLE;
+        } else if (strcmp(value, "lz") == 0) {
+            options->codec = CODEC_LZ;
+        } else if (strcmp(value, "auto") == 0) {
+            options->codec = CODEC_AUTO;
+        } else {
+            fprintf(stderr, "Error: Unknown codec '%s'.\n", value);
+            return -1;
+        }
+    } else if (strcmp(option, "--geometry") == 0) {
+        if (sscanf(value, "%u,%u", &options->sectors_per_track, &options->heads) != 2 ||
+            options->sectors_per_track < 2 || options->sectors_per_track > 63 || options->heads < 1 ||
+            options->heads > 255) {
+            fprintf(stderr, "Error: Invalid geometry '%s'.\n", value);
+            return -1;
+        }
+    } else {
+        return 0;
+    }
+    (*arg)++;
+    return 1;
+}
+
+/**
+ * One entry of a batch manifest: an input packed into an output with options of its own.
+ */
+struct batch_entry {
+    const char *input;
+    const char *output;
+    unsigned int line;                       // Line of the manifest, for the report
+    struct pack_options options;
+    struct pack_result result;
+    int failed;                              // Set when packing the entry failed
+};
+
+/**
+ * Entries shared by the batch worker threads, which take the next entry until none are left.
+ */
+struct batch_pool {
+    struct batch_entry *entries;
+    size_t count;                            // Number of entries
+    size_t next;                             // Next entry to pack
+    pthread_mutex_t lock;                    // Protects 'next'
+};
+
+/**
+ * Packs one entry of a batch with a worker's encoder and output buffer.
+ *
+ * The input is mapped (see map_input()) and the payload built in the worker's buffer, which
+ * is written to the output file with a single write() once the header is patched in, so a
+ * greedy single stream packs without allocating anything. The optimal parse and block-parallel
+ * mode allocate their scratch buffers per input as they do outside a batch.
+ *
+ * @param entry   Pointer to the entry.
+ * @param enc     Pointer to the worker's encoder, which keeps its LZ state between entries.
+ * @param packed  Pointer to the worker's output buffer in memory.
+ * @return        0 on success, 1 on failure.
+ */
+static int batch_pack(struct batch_entry *entry, struct encoder *enc, struct emitter *packed) {
+    int fd = open(entry->input, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Opening input file '%s' failed.\n", entry->input);
+        return 1;
+    }
+    struct stat info;
+    size_t length = fstat(fd, &info) == 0 ? (size_t)info.st_size : 0;
+    void *mapping = length > 0 ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Error: Input file '%s' is empty or cannot be mapped.\n", entry->input);
+        return 1;
+    }
+    const unsigned char *data = mapping;
+    madvise(mapping, length, MADV_SEQUENTIAL);
+
+    struct checksum sum = { 0, 0, 0 };
+    unsigned char header[HEADER_SIZE];
+    checksum_update(&sum, data, length);
+    emit_reset(packed);
+    int failed = pack_input(data, length, &entry->options, enc, packed, &entry->result) ||
+                 finish_payload(packed, NULL, &sum, &entry->options, &entry->result, header) || packed->failed;
+    munmap(mapping, length);
+    if (failed) {
+        return 1;
+    }
+    memcpy(packed->data, header, HEADER_SIZE);
+
+    fd = open(entry->output, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Opening output file '%s' failed.\n", entry->output);
+        return 1;
+    }
+    size_t written = 0;
+    ssize_t n;
+    while (written < packed->total && (n = write(fd, packed->data + written, packed->total - written)) > 0) {
+        written += n;
+    }
+    if (close(fd) != 0 || written != packed->total) {
+        fprintf(stderr, "Error: Writing the output file '%s' failed.\n", entry->output);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Batch worker thread, packs entries from the pool until all are taken.
+ *
+ * The encoder and the output buffer are the worker's own and reused for every entry it takes,
+ * the buffer growing to the largest payload.
+ *
+ * @param arg  Pointer to the batch pool.
+ * @return     NULL.
+ */
+static void *batch_worker(void *arg) {
+    struct batch_pool *pool = arg;
+    struct encoder enc = { .codec = CODEC_RLE, .keep = 1 };
+    struct emitter packed;
+    int ready = emit_init(&packed, EMIT_BUFFER_SIZE, NULL) == 0;
+
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        size_t i = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        if (i >= pool->count) {
+            break;
+        }
+        pool->entries[i].failed = !ready || batch_pack(&pool->entries[i], &enc, &packed);
+    }
+
+    if (ready) {
+        free(packed.data);
+    }
+    free(enc.lz);
+    return NULL;
+}
+
+/**
+ * Packs every entry of a batch manifest in one run ('--batch') and prints one report for all.
+ *
+ * A line of the manifest is an entry, '[options] <input file> <output file>', with the packing
+ * options of the command line ('--geometry', '--codec', '--optimal' and '--threads') on top of
+ * those given before '--batch'; blank lines and the rest of a line after '#' are skipped. Paths
+ * cannot hold whitespace. Inputs are mapped, so '--stream' and stdin are not taken; neither are
+ * '--cache' and '--format' before '--batch', which describe a single payload.
+ *
+ * The entries are shared by a pool of worker threads (every CPU unless '--threads' is given
+ * before the manifest), which take the next entry until none are left. Each worker packs its
+ * entries one after another with its own reused encoder and buffer, so '--threads' in an entry
+ * only selects block-parallel mode, whose blocks the worker packs itself. The report lists the
+ * sizes, ratio and sectors of every entry in manifest order, then the totals and the throughput:
+ * input (unpacked) megabytes (10^6 bytes) per second of wall-clock time.
+ *
+ * @param count     Number of arguments.
+ * @param args      '--threads <count>' (optional) and the manifest.
+ * @param defaults  Packing options given before '--batch'.
+ * @return          0 on success, 1 if the manifest is invalid or any entry failed.
+ */
+int batch(int count, char *args[], const struct pack_options *defaults) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int threads = cpus > 0 ? cpus : 1;
+    int arg = 0;
+
+    if (count == 3 && strcmp(args[0], "--threads") == 0) {
+        int requested;
+        if (sscanf(args[1], "%d", &requested) != 1 || requested < 0) {
+            fprintf(stderr, "Error: Invalid thread count '%s'.\n", args[1]);
+            return 1;
+        }
+        if (requested > 0) {
+            threads = requested;             // 0 uses every CPU, like the default
+        }
+        arg = 2;
+    }
+    if (count - arg != 1) {
+        fprintf(stderr, "Usage: packer [options] --batch [--threads <count>] <manifest>\n");
+        return 1;
+    }
+    if (defaults->stream) {
+        fprintf(stderr, "Error: '--stream' cannot be combined with '--batch'.\n");
+        return 1;
+    }
+
+    // Read the manifest whole, the entries point into it
+    FILE *file = fopen(args[arg], "rb");
+    if (!file) {
+        perror("Error opening manifest");
+        return 1;
+    }
+    fseek(file, 0, SEEK_END);
+    size_t size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *manifest = malloc(size + 1);
+    if (!manifest || fread(manifest, 1, size, file) != size) {
+        perror("Error reading manifest");
+        free(manifest);
+        fclose(file);
+        return 1;
+    }
+    fclose(file);
+    manifest[size] = '\0';
+
+    size_t lines = 1;
+    for (size_t i = 0; i < size; i++) {
+        lines += manifest[i] == '\n';
+    }
+    struct batch_pool pool = { .count = 0, .next = 0 };
+    pool.entries = calloc(lines, sizeof(*pool.entries));
+    pthread_t *workers = calloc(threads, sizeof(*workers));
+    if (!pool.entries || !workers) {
+        perror("Memory allocation failed");
+        free(pool.entries);
+        free(workers);
+        free(manifest);
+        return 1;
+    }
+
+    // Split every line into words in place and parse them into an entry
+    int failed = 0;
+    char *line = manifest;
+    for (unsigned int number = 1; line && !failed; number++) {
+        char *end = strchr(line, '\n');
+        if (end) {
+            *end = '\0';
+        }
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+
+        char *words[16];
+        int found = 0;
+        for (char *word = strtok(line, " \t\r"); word; word = strtok(NULL, " \t\r")) {
+            if (found == sizeof(words) / sizeof(words[0])) {
+                fprintf(stderr, "Error: Too many words on line %u of the manifest.\n", number);
+                failed = 1;
+                break;
+            }
+            words[found++] = word;
+        }
+        line = end ? end + 1 : NULL;
+        if (found == 0 || failed) {
+            continue;
+        }
+
+        struct batch_entry *entry = &pool.entries[pool.count];
+        entry->options = *defaults;
+        entry->line = number;
+        int word = 0;
+        for (; word < found - 2 && !failed; word++) {
+            int parsed = parse_pack_option(found - 2, words, &word, &entry->options);
+            if (parsed > 0 && entry->options.stream) {
+                fprintf(stderr, "Error: '--stream' is not allowed in batch mode (line %u of the manifest).\n",
+                        number);
+                failed = 1;
+            } else if (parsed <= 0) {
+                if (parsed == 0) {
+                    fprintf(stderr, "Error: Unknown batch option '%s' on line %u of the manifest.\n", words[word],
+                            number);
+                }
+                failed = 1;
+            }
+        }
+        if (!failed && word != found - 2) {
+            fprintf(stderr, "Error: Line %u of the manifest is not '[options] <input file> <output file>'.\n",
+                    number);
+            failed = 1;
+        }
+        if (entry->options.threads >= 0) {
+            entry->options.threads = 1;      // The worker packs the blocks, the pool is busy already
+        }
+        entry->input = words[found - 2];
+        entry->output = words[found - 1];
+        pool.count++;
+    }
+    if (!failed && pool.count == 0) {
+        fprintf(stderr, "Error: The manifest lists no inputs.\n");
+        failed = 1;
+    }
+    if (failed) {
+        free(pool.entries);
+        free(workers);
+        free(manifest);
+        return 1;
+    }
+
+    // The calling thread packs entries too, so one extra worker per further thread
+    double start = bench_now();
+    pthread_mutex_init(&pool.lock, NULL);
+    unsigned int started = 0;
+    for (; started + 1 < threads && started + 1 < pool.count; started++) {
+        if (pthread_create(&workers[started], NULL, batch_worker, &pool) != 0) {
+            break;                           // Fewer threads, the running ones take the rest
+        }
+    }
+    batch_worker(&pool);
+    for (unsigned int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    pthread_mutex_destroy(&pool.lock);
+    double seconds = bench_now() - start;
+
+    // Print the report in manifest order
+    uint64_t original = 0, compressed = 0, sectors = 0;
+    size_t packed = 0;
+    printf("Batch complete:\n");
+    for (size_t i = 0; i < pool.count; i++) {
+        struct batch_entry *entry = &pool.entries[i];
+        if (entry->failed) {
+            printf("  %s -> %s: failed (line %u)\n", entry->input, entry->output, entry->line);
+            failed = 1;
+            continue;
+        }
+        struct pack_result *r = &entry->result;
+        printf("  %s -> %s: %u bytes, compressed %u bytes (%.2f%%), %u sectors\n", entry->input, entry->output,
+               r->original_size, r->compressed_size, (100.0 * r->compressed_size) / r->original_size, r->sectors);
+        original += r->original_size;
+        compressed += r->compressed_size;
+        sectors += r->sectors;
+        packed++;
+    }
+    printf("  Packed: %zu of %zu files (%u thread%s)\n", packed, pool.count, started + 1, started ? "s" : "");
+    printf("  Original size: %llu bytes\n", (unsigned long long)original);
+    printf("  Compressed size: %llu bytes\n", (unsigned long long)compressed);
+    if (original > 0) {
+        printf("  Compression ratio: %.2f%%\n", (100.0 * compressed) / original);
+    }
+    printf("  Total sectors (512 bytes each): %llu\n", (unsigned long long)sectors);
+    printf("  Throughput: %.2f MB/s (%.3f seconds)\n", seconds > 0 ? original / seconds / 1e6 : 0.0, seconds);
+
+    free(pool.entries);
+    free(workers);
+    free(manifest);
+    return failed;
+}
+
+/**
+ * Prints the command line usage.
+ *
+ * @param program Name of the program (argv[0]).
+ */
+void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--geometry <sectors per track>,<heads>] [--codec rle|lz|auto] [--stream | --optimal | --threads <count>] [--cache <directory>] [--format <include file>] <input file> <output file>\n", program);
+    fprintf(stderr, "  --codec    Compression backend, RLE (default) or LZSS, or 'auto' to choose stored, RLE or LZSS per block\n");
+    fprintf(stderr, "  --stream   Pack the input in fixed-size chunks instead of reading it whole ('-' reads stdin)\n");
+    fprintf(stderr, "  --optimal  Search for the smallest encoding instead of packing in a single greedy pass\n");
+    fprintf(stderr, "  --threads  Pack independent blocks on this many threads (0 uses every CPU)\n");
+    fprintf(stderr, "  --format   Write the payload format as a NASM include, for a bootloader that decodes only it\n");
+    fprintf(stderr, "  --cache    Reuse the payload packed earlier from the same input and options, kept in this directory\n");
+    fprintf(stderr, "Verify:    %s --verify <input file> <packed file>\n", program);
+    fprintf(stderr, "  Decodes the packed file the way the bootloader does and compares it with the input\n");
+    fprintf(stderr, "Unpack:    %s --unpack <packed file> <output file>\n", program);
+    fprintf(stderr, "  Decodes the packed file the way the bootloader does into the output file\n");
+    fprintf(stderr, "Image:     %s --image [--hdd] [--select <entry>] [--stage2 <second stage>] <bootloader> <packed file>... <output image>\n", program);
+    fprintf(stderr, "  Writes a floppy (or hard disk) image that boots the selected packed file, '--stage2' lays out\n");
+    fprintf(stderr, "  the two-stage loader: stage1.asm as the bootloader and 'boot.asm -DSTAGE2' after the directory\n");
+    fprintf(stderr, "Batch:     %s [options] --batch [--threads <count>] <manifest>\n", program);
+    fprintf(stderr, "  Packs every '[options] <input file> <output file>' line of the manifest on a pool of threads\n");
+    fprintf(stderr, "  (every CPU unless given) and prints one report, the options above apply to every line\n");
+    fprintf(stderr, "Benchmark: %s --benchmark <input file>...\n", program);
+    fprintf(stderr, "  Packs and decodes every input with every codec and mode, and writes the results as JSON\n");
+}
+
+/**
+ * Main function that encrypts, compresses, and writes an input file to the output file.
+ *
+ * Usage:
+ *   ./packer [--geometry <sectors per track>,<heads>] [--codec rle|lz|auto] [--stream | --optimal | --threads <count>]
+ *            [--cache <directory>] [--format <include file>] <input file> <output file>
+ * 
+ * Example:
+ *   ./packer --codec lz application.bin application-packed.bin
+ *
+ * '--verify <input file> <packed file>' checks a payload with verify(), '--unpack <packed file>
+ * <output file>' decodes one with unpack(), and '--image' and '--benchmark <input file>...'
+ * (which take the rest of the command line) run build_image() and benchmark(); none of them pack.
+ * '--batch [--threads <count>] <manifest>' packs every entry of a manifest in one run, see batch(),
+ * with the packing options given before it as the defaults of every entry.
+ *
+ * The geometry defaults to a 1.44 MB floppy (18 sectors per track, 2 heads), and the
+ * compression backend to RLE. '--codec auto' chooses the codec of every block (or of the
+ * single stream) from its statistics, see choose_codec(). With
+ * '--stream' the input is packed in fixed-size chunks, and an input file of '-' reads
+ * from stdin (which implies '--stream'). The output file must be seekable. '--optimal' needs
+ * the whole input in memory, so it cannot be combined with '--stream', and neither can
+ * '--codec auto' (which scans the input first) or '--threads', which splits the input into blocks that are packed in parallel (each block with the optimal
+ * parse when combined with '--optimal') and that the bootloader decodes while it loads the rest.
+ * '--cache' keeps every payload in a directory under a hash of the input and the options, and
+ * copies it from there instead of packing when the same input is packed the same way again.
+ * '--format' writes the format of the payload as a NASM include, see write_format().
+ * Outside streaming mode the input is mapped rather than read (see map_input()), and the
+ * payload is emitted straight into the mapped output file (see emit_init_mapped()).
+ *
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @return     0 on success, 1 on failure.
+ */
+int main(int argc, char *argv[]) {
+    struct pack_options options = { DEFAULT_SECTORS_PER_TRACK, DEFAULT_HEADS, CODEC_RLE, 0, 0, -1 };
+    const char *cache_dir = NULL;
+    const char *format_path = NULL;          // NASM include of the payload format, if wanted
+
+    run_length_init();                       // Before any thread is started
+
+    // Parse options
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-' && argv[arg][1] != '\0'; arg++) {
+        if (strcmp(argv[arg], "--benchmark") == 0) {
+            return benchmark(argc - arg - 1, argv + arg + 1);
+        } else if (strcmp(argv[arg], "--image") == 0) {
+            return build_image(argc - arg - 1, argv + arg + 1);
+        } else if (strcmp(argv[arg], "--batch") == 0) {
+            if (cache_dir || format_path) {
+                fprintf(stderr, "Error: '%s' cannot be combined with '--batch'.\n", cache_dir ? "--cache" : "--format");
+                return 1;
+            }
+            return batch(argc - arg - 1, argv + arg + 1, &options);
+        } else if (strcmp(argv[arg], "--verify") == 0 && argc - arg == 3) {
+            return verify(argv[arg + 1], argv[arg + 2]);
+        } else if (strcmp(argv[arg], "--unpack") == 0 && argc - arg == 3) {
+            return unpack(argv[arg + 1], argv[arg + 2]);
+        } else if (strcmp(argv[arg], "--cache") == 0 && arg + 1 < argc) {
+            cache_dir = argv[++arg];
+        } else if (strcmp(argv[arg], "--format") == 0 && arg + 1 < argc) {
+            format_path = argv[++arg];
+        } else {
+            int parsed = parse_pack_option(argc, argv, &arg, &options);
+            if (parsed <= 0) {
+                if (parsed == 0) {
+                    usage(argv[0]);
+                }
+                return 1;
+            }
+        }
+    }
+    if (argc - arg != 2) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Open input and output files, '-' reads the input from stdin
+    if (strcmp(argv[arg], "-") == 0) {
+        options.stream = 1;
+    }
+    if (options.stream && (options.optimal || options.threads >= 0 || options.codec == CODEC_AUTO)) {
+        fprintf(stderr, "Error: '%s' cannot be combined with streaming input.\n",
+                options.optimal ? "--optimal" : options.threads >= 0 ? "--threads" : "--codec auto");
+        return 1;
+    }
+
+    // Reuse the payload of an earlier run with the same input and options, stdin is never cached
+    char cached[4096] = "";
+    if (cache_dir && strcmp(argv[arg], "-") != 0) {
+        char key[256];
+        snprintf(key, sizeof(key), "source %s header %d codec %d stream %d optimal %d blocks %d geometry %u,%u",
+                 PACKER_SOURCE, HEADER_VERSION, options.codec, options.stream, options.optimal, options.threads >= 0,
+                 options.sectors_per_track, options.heads);
+        if (cache_path(cache_dir, argv[arg], key, cached, sizeof(cached))) {
+            perror("Error opening input file");
+            return 1;
+        }
+        if (access(cached, R_OK) == 0) {
+            if (copy_file(cached, argv[arg + 1])) {
+                fprintf(stderr, "Error: Copying the cached payload '%s' failed.\n", cached);
+                return 1;
+            }
+            printf("Packing skipped: %s is unchanged, reused %s\n", argv[arg], cached);
+            return format_path ? write_format(argv[arg + 1], format_path) : 0;
+        }
+    }
+    FILE *input = options.stream && strcmp(argv[arg], "-") == 0 ? stdin : fopen(argv[arg], "rb");
+    FILE *output = fopen(argv[arg + 1], "w+b");
+    if (!input) {
+        perror("Error opening input file");
+        return 1;
+    }
+    if (!output) {
+        perror("Error opening output file");
+        fclose(input);
+        return 1;
+    }
+
+    struct pack_result result = { .blocks = 1 };
+    struct checksum sum = { 0, 0, 0 };
+    unsigned char *data = NULL;
+    size_t length = 0;
+    int data_mapped = 0;                     // The input is mapped rather than read into memory
+    struct emitter packed;
+    struct encoder enc = { .codec = CODEC_RLE }; // Selected by pack_input() outside streaming mode
+    int failed;
+
+    // Buffer the packed output, in streaming mode it is flushed to the file as it fills up,
+    // otherwise the buffer maps the output file (or stays in memory if it cannot be mapped)
+    if ((options.stream || emit_init_mapped(&packed, EMIT_BUFFER_SIZE, fileno(output))) &&
+        emit_init(&packed, EMIT_BUFFER_SIZE, options.stream ? output : NULL)) {
+        fclose(input);
+        fclose(output);
+        return 1;
+    }
+
+    if (options.stream) {
+        // Encrypt and compress the input chunk by chunk, after room for the header
+        failed = encoder_init(&enc, options.codec);
+        if (!failed) {
+            emit_fill(&packed, 0, HEADER_SIZE);
+            emit_stream_index(&packed, options.codec);
+            result.used[options.codec]++;
+            failed = pack_stream(input, &enc, &packed, &result.original_size, &sum);
+        }
+        fclose(input);
+    } else {
+        // Map the input file, or read it into memory if it cannot be mapped
+        fseek(input, 0, SEEK_END);
+        length = ftell(input);               // Store the original file size
+        fseek(input, 0, SEEK_SET);
+
+        data = map_input(input, length, &data_mapped);
+        fclose(input);
+        failed = !data;
+        if (!failed) {
+            checksum_update(&sum, data, length);
+            failed = pack_input(data, length, &options, &enc, &packed, &result);
+        }
+    }
+    free(enc.lz);
+
+    // Pad the payload and fill in the header with the final sector count, then write the output
+    unsigned char header[HEADER_SIZE];
+    if (failed || finish_payload(&packed, output, &sum, &options, &result, header)) {
+        emit_release(&packed);
+        fclose(output);
+        release_input(data, length, data_mapped);
+        return 1;
+    }
+
+    if (packed.total == packed.length) {
+        memcpy(packed.data, header, HEADER_SIZE); // Nothing flushed yet, patch the buffer
+        if (packed.fd >= 0) {
+            emit_release(&packed);           // The buffer is the file, cut it to the payload
+        } else {
+            packed.flush = output;
+            emit_flush(&packed);
+        }
+    } else {
+        if (fseek(output, 0, SEEK_SET) != 0 || fwrite(header, 1, HEADER_SIZE, output) != HEADER_SIZE) {
+            packed.failed = 1;               // Streaming mode, the rest is already on disk
+        }
+    }
+
+    if (packed.failed || fclose(output) != 0) {
+        fprintf(stderr, "Error: Writing the output file failed.\n");
+        release_input(data, length, data_mapped);
+        emit_release(&packed);
+        return 1;
+    }
+
+    // Print summary of results
+    printf("Packing complete:\n");
+    if (options.codec == CODEC_AUTO) {
+        printf("  Codec: auto (%u LZSS, %u RLE, %u stored)\n", result.used[CODEC_LZ], result.used[CODEC_RLE],
+               result.used[CODEC_STORED]);
+    } else {
+        printf("  Codec: %s\n", options.codec == CODEC_LZ ? "LZSS" : "RLE");
+    }
+    if (options.optimal && options.threads >= 0) {
+        printf("  Parse: optimal (per block)\n");
+    } else if (options.optimal) {
+        if (result.level > 0) {
+            printf("  Parse: optimal (level %u of %u)\n", result.level, result.levels);
+        } else {
+            printf("  Parse: greedy (no smaller optimal parse)\n");
+        }
+    }
+    if (options.threads >= 0) {
+        printf("  Blocks: %u (%d threads)\n", result.blocks, options.threads);
+    }
+    printf("  Original size: %u bytes\n", result.original_size);
+    printf("  Compressed size: %u bytes\n", result.compressed_size);
+    printf("  Compression ratio: %.2f%%\n", (100.0 * result.compressed_size) / result.original_size);
+    printf("  Total sectors (512 bytes each): %u\n", result.sectors);
+    printf("  In-place margin: %zu bytes\n", result.margin);
+
+    // Describe the payload for a bootloader specialized to it
+    if (format_path && write_format(argv[arg + 1], format_path)) {
+        release_input(data, length, data_mapped);
+        emit_release(&packed);
+        return 1;
+    }
+
+    // Keep the payload for the next run with the same input and options
+    if (cached[0]) {
+        mkdir(cache_dir, 0777);              // Fails harmlessly if the cache exists
+        if (copy_file(argv[arg + 1], cached)) {
+            fprintf(stderr, "Warning: Could not store the payload in the cache '%s'.\n", cache_dir);
+        }
+    }
+
+    release_input(data, length, data_mapped);
+    emit_release(&packed);
+
+    return 0;
+}
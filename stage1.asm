@@ -0,0 +1,131 @@
+; stage1.asm
+;
+; Author: Patrik Sporre
+; License: MIT License
+;
+; This is the first stage of the two-stage bootloader. It does no more than load the second
+; stage, the full loader in boot.asm assembled with '-DSTAGE2', from the sectors after the
+; directory and jump to it. The second stage is then free of the 510 byte limit of the boot
+; sector, which leaves room for the faster decoders and for every debug and profiling option
+; at once.
+;
+; Usage:
+; - Assemble both stages using NASM:
+;     nasm -f bin stage1.asm -o boot.bin
+;     nasm -f bin -DSTAGE2 boot.asm -o stage2.bin
+;
+; - Write the image with the packer, which lays out both stages:
+;     ./packer --image --stage2 stage2.bin boot.bin application-packed.bin floppy.img
+;
+; Disk layout:
+; - Sector 0: this boot sector
+; - Sector 1: the directory (see boot.asm), its byte at offset 7 holds the number of
+;   second stage sectors; 0, an image made without '--stage2', stops at 'error'
+; - Sector 2 on: the second stage, then the packed applications
+;
+; The directory and the second stage are read by CHS from the first track, so the second
+; stage has to fit the first track after the directory (the packer checks it) and in the
+; memory from STAGE2_ADDR up to the decoder output at 0xa000, its variables included: at
+; most 14 sectors, STAGE2_MAX_SECTORS in boot.asm and packer.c.
+;
+; Registers passed to the second stage:
+;   - DL: Boot drive number, as the BIOS passed it
+;   - DS, ES, SS: 0x0000, SP: 0x7c00
+;
+; MIT License:
+;
+; Copyright (c) 2024 Patrik Sporre
+;
+; Permission is hereby granted, free of charge, to any person obtaining a copy
+; of this software and associated documentation files (the "Software"), to deal
+; in the Software without restriction, including without limitation the rights
+; to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+; copies of the Software, and to permit persons to whom the Software is
+; furnished to do so, subject to the following conditions:
+;
+; The above copyright notice and this permission notice shall be included in all
+; copies or substantial portions of the Software.
+;
+; THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+; IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+; FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+; AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+; LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+; OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+; SOFTWARE.
+
+bits 16                     ; Instruct NASM that this is 16 bit (real mode) code
+org 0x7c00                  ; Origin where BIOS loads the bootloader
+
+%define DIRECTORY_ADDR 0x7e00 ; Directory sector, right after the boot sector (as in boot.asm)
+%define STAGE2_ADDR    0x8000 ; Second stage, right after the directory (as in boot.asm)
+%define DIR_STAGE2     7    ; Directory offset: number of second stage sectors (byte)
+%define READ_RETRIES   5    ; Read retries before giving up
+
+section .text               ; Code section
+
+start:
+    ; Setup segments and stack, DL keeps the boot drive number from BIOS
+    cli                     ; Disable interrupts
+    xor ax, ax              ; Zero out AX
+    mov ds, ax              ; Set DS (data segment) to 0x0000
+    mov es, ax              ; Set ES (extra segment) to 0x0000
+    mov ss, ax              ; Set SS (stack segment) to 0x0000
+    mov sp, 0x7c00          ; Set SP (stack pointer) to 0x7c00 (stack grows downwards)
+    sti                     ; Enable interrupts
+
+    ; Read the directory sector, it gives the size of the second stage
+    mov bx, DIRECTORY_ADDR  ; ES:BX points to the directory
+    mov cx, 0x0002          ; Cylinder 0 (CH), sector 2 in 1-based indexing (CL)
+    xor dh, dh              ; Head 0
+    mov al, 1               ; A single sector
+    call read_sectors
+
+    ; Read the second stage from the sectors after the directory, and run it
+    mov bx, STAGE2_ADDR     ; ES:BX points to the second stage
+    mov cl, 0x03            ; Sector 3, right after the directory
+    mov al, [DIRECTORY_ADDR + DIR_STAGE2]
+    test al, al             ; None in an image made without '--stage2', nothing to run
+    jz error
+    call read_sectors
+    jmp 0x0000:STAGE2_ADDR  ; Set CS and IP correctly with far jump
+
+;------------------------------------------------------------------------------
+; Read sectors - Reads AL sectors at CH/CL/DH into ES:BX
+;
+; A failed read is retried after a disk reset (AH=00h), drives often fail the
+; first reads while the motor spins up, READ_RETRIES times before giving up.
+;------------------------------------------------------------------------------
+read_sectors:
+    mov si, READ_RETRIES    ; Retries left
+
+read_retry:
+    mov ah, 0x02            ; BIOS function to read sectors
+    push ax                 ; Keep the sector count, not every BIOS returns it in AL
+    int 0x13
+    pop ax
+    jnc read_done
+
+    push ax
+    xor ah, ah              ; Reset the disk system (AH=00h)
+    int 0x13
+    pop ax
+    dec si
+    jnz read_retry
+
+error:
+%ifdef DEBUG
+    mov ax, 0x0e00 | 'E'    ; Display 'E' for error with the BIOS teletype function
+    int 0x10
+%endif
+
+halt_loop:
+    hlt                     ; Halt in case of error
+    jmp halt_loop           ; Infinite loop on error
+
+read_done:
+    ret
+
+; Boot sector padding and signature
+    times 510-($-$$) db 0   ; Pad the boot sector to 510 bytes
+    dw 0xaa55               ; Boot sector signature (0xaa55), required for a bootable sector
@@ -0,0 +1,100 @@
+#!/bin/bash
+
+# test.sh
+#
+# This script checks the packer on generated inputs: that every payload decodes back to its
+# input ('packer --verify'), and the properties of the codecs and payloads that the build
+# scripts rely on.
+#
+# Usage:
+#   ./test.sh
+#
+# Note: Make sure the script is executable before running it:
+#   chmod +x test.sh
+#
+# Requirements:
+#   Ensure that GCC is available.
+#
+# Checks:
+#   1. '--codec auto' never packs an input that mixes runs and random bytes larger than RLE,
+#      as a single stream or in blocks
+#   2. A payload loaded one sector earlier than its header says, so that its in-place margin
+#      is too small and the output overwrites literals not read yet, fails '--verify'
+
+# File paths
+WORK="$(mktemp -d)"                       # Inputs and payloads, removed when done
+trap 'rm -rf "$WORK"' EXIT
+FAILED=0
+
+# Compile the packer, unless it is already built from this very source
+if [ -x packer ] && sha256sum --status -c packer.sha256 2> /dev/null; then
+    echo "Packer is up to date."
+else
+    echo "Compiling the packer..."
+    SOURCE_HASH=$(sha256sum packer.c | cut -d ' ' -f 1)   # Keys the packing cache, see packer.c
+    gcc -O2 -pthread -DPACKER_SOURCE="\"$SOURCE_HASH\"" packer.c -o packer || { echo "Packer compilation failed"; exit 1; }
+    sha256sum packer.c > packer.sha256
+fi
+
+# Reports a check as passed or failed
+check() {
+    local name="$1"
+    shift
+    if "$@"; then
+        echo "ok    $name"
+    else
+        echo "FAIL  $name"
+        FAILED=1
+    fi
+}
+
+# Packs an input with the given options, verifies the payload and prints its compressed size
+packed_size() {
+    local input="${@: -1}"
+    ./packer "${@:1:$#-1}" "$input" "$WORK/packed.bin" > "$WORK/summary.txt" || return 1
+    ./packer --verify "$input" "$WORK/packed.bin" > /dev/null || return 1
+    awk '/Compressed size/ { print $3 }' "$WORK/summary.txt"
+}
+
+# Checks that '--codec auto' packs an input no larger than RLE does
+auto_not_larger() {
+    local rle auto
+    rle=$(packed_size --codec rle "$@") && auto=$(packed_size --codec auto "$@") || return 1
+    echo "      RLE $rle bytes, auto $auto bytes"
+    [ "$auto" -le "$rle" ]
+}
+
+# Checks that a payload fails '--verify' once its load segment (header offset 10) is a sector lower
+short_margin_fails() {
+    ./packer "$@" "$WORK/packed.bin" > /dev/null || return 1
+    ./packer --verify "${@: -1}" "$WORK/packed.bin" > /dev/null || return 1
+    local segment bytes
+    segment=$(od -An -tu2 -j10 -N2 "$WORK/packed.bin" | tr -d ' ')
+    segment=$((segment - 512 / 16))
+    [ "$segment" -ge $((0xa000 / 16)) ] || return 1 # Still in the load window, only the margin is short
+    printf -v bytes '\\x%02x\\x%02x' $((segment & 255)) $((segment >> 8))
+    printf "$bytes" | dd of="$WORK/packed.bin" bs=1 seek=10 conv=notrunc status=none
+    ! ./packer --verify "${@: -1}" "$WORK/packed.bin" > /dev/null 2>&1
+}
+
+# Build the inputs
+echo "Building the test inputs..."
+for i in $(seq 600); do
+    head -c $((i % 37 + 1)) /dev/urandom
+    head -c $((i % 53 + 3)) /dev/zero | tr '\0' "\\$(printf '%03o' $((i % 256)))"
+done > "$WORK/mixed.bin"
+{
+    head -c 32768 /dev/zero
+    head -c 16384 /dev/urandom
+} > "$WORK/overlap.bin"                   # Gets ahead on the zeros, then decodes literals
+
+# Run the checks
+check "auto is no larger than RLE on runs and random bytes" auto_not_larger "$WORK/mixed.bin"
+check "auto is no larger than RLE on runs and random bytes, in blocks" auto_not_larger --threads 1 "$WORK/mixed.bin"
+check "a payload loaded a sector too early fails verification" short_margin_fails --codec rle "$WORK/overlap.bin"
+
+if [ "$FAILED" -ne 0 ]; then
+    echo "Some checks failed"
+    exit 1
+fi
+echo "All checks passed"